@@ -0,0 +1,499 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MINIMP3_IMPLEMENTATION
+#include "minimp3_ex.h"
+
+#include "cdg.h"
+#include "util.h"
+
+/*
+ * cdg-bench: time the decoder's hot paths and print the results as JSON on stdout, so they can be
+ * compared between releases. Without arguments it measures synthetic packet streams and a synthetic
+ * song; CDG files given on the command line are measured as well, and an MP3 given with -m has its
+ * decode speed measured.
+ */
+
+#define BENCH_STREAM_PACKETS   65536
+#define BENCH_SONG_SECONDS     240
+#define BENCH_FRAME_PACKETS    (CDG_PACKETS_PER_SECOND / 30) /* How far playback seeks per video frame */
+#define BENCH_BACKWARD_SEEKS   4096
+#define BENCH_DEFAULT_SECONDS  0.25                         /* Minimum time to spend on each measurement */
+
+/* Kinds of packet a stream can be made of */
+enum bench_packet {
+    BENCH_PACKET_NOT_CDG,
+    BENCH_PACKET_MEMORY_PRESET,
+    BENCH_PACKET_BORDER_PRESET,
+    BENCH_PACKET_TILE_BLOCK,
+    BENCH_PACKET_TILE_BLOCK_XOR,
+    BENCH_PACKET_SCROLL_PRESET,
+    BENCH_PACKET_SCROLL_COPY,
+    BENCH_PACKET_DEF_TRANSPARENT,
+    BENCH_PACKET_LOAD_COLOR_TABLE,
+    BENCH_PACKET_KINDS
+};
+
+/* A stream of packets, with each kind making up `weights[kind]` parts of it */
+struct bench_mix {
+    const char *name;
+    int weights[BENCH_PACKET_KINDS];
+};
+
+/* The first BENCH_PACKET_KINDS are each kind on its own, so mixes[kind] is that kind's stream */
+static const struct bench_mix mixes[] = {
+    { "not_cdg",          { 1, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { "memory_preset",    { 0, 1, 0, 0, 0, 0, 0, 0, 0 } },
+    { "border_preset",    { 0, 0, 1, 0, 0, 0, 0, 0, 0 } },
+    { "tile_block",       { 0, 0, 0, 1, 0, 0, 0, 0, 0 } },
+    { "tile_block_xor",   { 0, 0, 0, 0, 1, 0, 0, 0, 0 } },
+    { "scroll_preset",    { 0, 0, 0, 0, 0, 1, 0, 0, 0 } },
+    { "scroll_copy",      { 0, 0, 0, 0, 0, 0, 1, 0, 0 } },
+    { "def_transparent",  { 0, 0, 0, 0, 0, 0, 0, 1, 0 } },
+    { "load_color_table", { 0, 0, 0, 0, 0, 0, 0, 0, 1 } },
+    // Roughly a typical karaoke track: mostly empty subchannel data, lyrics drawn with tile blocks
+    { "song",             { 720, 1, 4, 120, 120, 0, 0, 0, 35 } },
+};
+
+/* xorshift32 - the same streams on every run, so results are comparable */
+static uint32_t bench_random(uint32_t *seed) {
+    uint32_t x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *seed = x;
+}
+
+static void bench_make_packet(struct subchannel_packet *pkt, enum bench_packet kind, uint32_t *seed) {
+    memset(pkt, 0, sizeof(struct subchannel_packet));
+
+    for (int i = 0; i < 16; i++) {
+        pkt->data[i] = bench_random(seed) & 0x3F;
+    }
+
+    pkt->command = 9;
+
+    switch (kind) {
+        case BENCH_PACKET_NOT_CDG:
+            pkt->command = 0;
+            break;
+        case BENCH_PACKET_MEMORY_PRESET:
+            pkt->instruction = CDG_INSN_MEMORY_PRESET;
+            pkt->data[1] = 0;
+            break;
+        case BENCH_PACKET_BORDER_PRESET:
+            pkt->instruction = CDG_INSN_BORDER_PRESET;
+            break;
+        case BENCH_PACKET_TILE_BLOCK:
+        case BENCH_PACKET_TILE_BLOCK_XOR:
+            pkt->instruction = kind == BENCH_PACKET_TILE_BLOCK ? CDG_INSN_TILE_BLOCK : CDG_INSN_TILE_BLOCK_XOR;
+            pkt->data[2] = bench_random(seed) % (CDG_SCREEN_HEIGHT / CDG_TILE_HEIGHT);
+            pkt->data[3] = bench_random(seed) % (CDG_SCREEN_WIDTH / CDG_TILE_WIDTH);
+            break;
+        case BENCH_PACKET_SCROLL_PRESET:
+        case BENCH_PACKET_SCROLL_COPY:
+            pkt->instruction = kind == BENCH_PACKET_SCROLL_PRESET ? CDG_INSN_SCROLL_PRESET : CDG_INSN_SCROLL_COPY;
+            pkt->data[1] = (bench_random(seed) % 3) << 4 | bench_random(seed) % CDG_TILE_WIDTH;
+            pkt->data[2] = (bench_random(seed) % 3) << 4 | bench_random(seed) % CDG_TILE_HEIGHT;
+            break;
+        case BENCH_PACKET_DEF_TRANSPARENT:
+            pkt->instruction = CDG_INSN_DEF_TRANSPARENT;
+            break;
+        case BENCH_PACKET_LOAD_COLOR_TABLE:
+            pkt->instruction = bench_random(seed) & 1 ? CDG_INSN_LOAD_COLOR_TABLE_08 : CDG_INSN_LOAD_COLOR_TABLE_00;
+            break;
+        default:
+            break;
+    }
+}
+
+static void bench_make_stream(struct subchannel_packet *packets, size_t count, const struct bench_mix *mix, uint32_t seed) {
+    int total = 0;
+
+    for (int i = 0; i < BENCH_PACKET_KINDS; i++) {
+        total += mix->weights[i];
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        int pick = (int) (bench_random(&seed) % (uint32_t) total);
+        int kind = 0;
+
+        while (pick >= mix->weights[kind]) {
+            pick -= mix->weights[kind++];
+        }
+
+        bench_make_packet(&packets[i], (enum bench_packet) kind, &seed);
+    }
+}
+
+static uint64_t bench_nanoseconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static void bench_write_string(const char *s) {
+    putchar('"');
+
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            printf("\\u%04x", (unsigned char) *s);
+        } else {
+            putchar(*s);
+        }
+    }
+
+    putchar('"');
+}
+
+static int bench_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sorts the samples */
+static void bench_write_percentiles(const char *name, uint64_t *samples, size_t count) {
+    qsort(samples, count, sizeof(uint64_t), bench_compare_u64);
+
+    printf("      \"%s\": {\"count\": %zu", name, count);
+
+    if (count > 0) {
+        printf(", \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu",
+               (unsigned long long) samples[count / 2], (unsigned long long) samples[count * 9 / 10],
+               (unsigned long long) samples[count * 99 / 100], (unsigned long long) samples[count - 1]);
+    }
+
+    printf("}");
+}
+
+static void bench_process_insn(const struct bench_mix *mix, double minSeconds) {
+    struct subchannel_packet *packets = (struct subchannel_packet *) malloc(sizeof(struct subchannel_packet) * BENCH_STREAM_PACKETS);
+    struct cdg_state *state = (struct cdg_state *) calloc(1, sizeof(struct cdg_state));
+    uint64_t processed = 0;
+    uint64_t updates = 0;
+    uint64_t start, elapsed;
+
+    CHECK_MEM(packets)
+    CHECK_MEM(state)
+
+    bench_make_stream(packets, BENCH_STREAM_PACKETS, mix, 0x9E3779B9);
+
+    start = bench_nanoseconds();
+
+    do {
+        for (size_t i = 0; i < BENCH_STREAM_PACKETS; i++) {
+            updates += cdg_state_process_insn(state, &packets[i]);
+        }
+
+        processed += BENCH_STREAM_PACKETS;
+        elapsed = bench_nanoseconds() - start;
+    } while (elapsed < minSeconds * 1e9);
+
+    printf("    {\"mix\": \"%s\", \"packets\": %llu, \"updates\": %llu, \"seconds\": %.6f, \"packets_per_second\": %.0f}",
+           mix->name, (unsigned long long) processed, (unsigned long long) updates, elapsed / 1e9, processed * 1e9 / elapsed);
+
+    free(state);
+    free(packets);
+}
+
+/*
+ * The tile rasterizer as it was originally written, a pixel at a time, as a baseline for the row at
+ * a time versions in the decoder. It's run over the same streams, minus the decoder's dispatch.
+ */
+static void bench_per_pixel_tiles(const struct bench_mix *mix, double minSeconds) {
+    struct subchannel_packet *packets = (struct subchannel_packet *) malloc(sizeof(struct subchannel_packet) * BENCH_STREAM_PACKETS);
+    uint8_t *framebuffer = (uint8_t *) calloc(1, CDG_FRAMEBUFFER_SIZE);
+    uint64_t processed = 0;
+    uint64_t start, elapsed;
+
+    CHECK_MEM(packets)
+    CHECK_MEM(framebuffer)
+
+    bench_make_stream(packets, BENCH_STREAM_PACKETS, mix, 0x9E3779B9);
+
+    start = bench_nanoseconds();
+
+    do {
+        for (size_t p = 0; p < BENCH_STREAM_PACKETS; p++) {
+            const struct cdg_insn_tile_block *tile = (const struct cdg_insn_tile_block *) packets[p].data;
+            int isXor = packets[p].instruction == CDG_INSN_TILE_BLOCK_XOR;
+            size_t startRow = (tile->row & 0x1F) * 12;
+            size_t startCol = (tile->column & 0x3F) * 6;
+
+            for (int i = 0; i < 12; i++) {
+                uint8_t tilePixels = tile->pixels[i] & 0x3F;
+
+                for (int j = 0; j < 6; j++) {
+                    uint8_t pixel = (tilePixels >> (5 - j)) & 1;
+                    uint8_t color = (pixel ? tile->color_1 : tile->color_0) & 0xF;
+
+                    if (isXor) {
+                        framebuffer[ARRAY_INDEX(startCol + j, startRow + i)] ^= color;
+                    } else {
+                        framebuffer[ARRAY_INDEX(startCol + j, startRow + i)] = color;
+                    }
+                }
+            }
+        }
+
+        processed += BENCH_STREAM_PACKETS;
+        elapsed = bench_nanoseconds() - start;
+    } while (elapsed < minSeconds * 1e9);
+
+    // Print a pixel so the work can't be optimized away
+    printf("    {\"mix\": \"%s\", \"packets\": %llu, \"pixel\": %d, \"seconds\": %.6f, \"packets_per_second\": %.0f}",
+           mix->name, (unsigned long long) processed, framebuffer[0], elapsed / 1e9, processed * 1e9 / elapsed);
+
+    free(framebuffer);
+    free(packets);
+}
+
+/* Write a synthetic song to a temporary file. Returns the path, which the caller must unlink and free. */
+static char *bench_make_song(void) {
+    size_t count = (size_t) BENCH_SONG_SECONDS * CDG_PACKETS_PER_SECOND;
+    struct subchannel_packet *packets = (struct subchannel_packet *) malloc(sizeof(struct subchannel_packet) * count);
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char *path = (char *) malloc(strlen(dir) + sizeof("/cdg-bench-XXXXXX"));
+    FILE *fp;
+    int fd;
+
+    CHECK_MEM(packets)
+    CHECK_MEM(path)
+
+    bench_make_stream(packets, count, &mixes[sizeof(mixes) / sizeof(mixes[0]) - 1], 0x2545F491);
+
+    sprintf(path, "%s/cdg-bench-XXXXXX", dir);
+
+    if ((fd = mkstemp(path)) == -1 || (fp = fdopen(fd, "wb")) == NULL) {
+        fprintf(stderr, "%s: failed to create synthetic song\n", path);
+        free(packets);
+        free(path);
+        return NULL;
+    }
+
+    if (fwrite(packets, sizeof(struct subchannel_packet), count, fp) != count || fclose(fp) != 0) {
+        fprintf(stderr, "%s: failed to write synthetic song\n", path);
+        unlink(path);
+        free(packets);
+        free(path);
+        return NULL;
+    }
+
+    free(packets);
+
+    return path;
+}
+
+static int bench_song(const char *path, const char *name, double minSeconds, int first) {
+    struct cdg_reader *reader = cdg_reader_new();
+    cdg_ts_t packetCount;
+    uint64_t *forward, *backward;
+    size_t forwardCount = 0;
+    uint64_t builds = 0;
+    uint64_t start, elapsed;
+    uint32_t seed = 0x6C078965;
+
+    if (!cdg_reader_load_file(reader, path)) {
+        fprintf(stderr, "%s: failed to open file\n", path);
+        cdg_reader_free(reader);
+        return 0;
+    }
+
+    packetCount = reader->buffer_size / sizeof(struct subchannel_packet);
+
+    // Keyframe list build, which decodes the whole song
+    start = bench_nanoseconds();
+
+    do {
+        cdg_reader_build_keyframe_list(reader);
+        builds++;
+        elapsed = bench_nanoseconds() - start;
+    } while (elapsed < minSeconds * 1e9);
+
+    printf("%s\n    {\"name\": ", first ? "" : ",");
+    bench_write_string(name);
+    printf(", \"bytes\": %zu, \"packets\": %llu, \"keyframes\": %zu,\n", reader->buffer_size,
+           (unsigned long long) packetCount, reader->keyframes.count);
+    printf("      \"keyframe_list\": {\"builds\": %llu, \"seconds\": %.6f, \"mb_per_second\": %.1f},\n",
+           (unsigned long long) builds, elapsed / 1e9, (double) reader->buffer_size * builds / (elapsed / 1e9) / 1e6);
+
+    // Forward seeks as in playback, a video frame's worth of packets at a time
+    forward = (uint64_t *) malloc(sizeof(uint64_t) * (packetCount / BENCH_FRAME_PACKETS + 1));
+    backward = (uint64_t *) malloc(sizeof(uint64_t) * BENCH_BACKWARD_SEEKS);
+
+    CHECK_MEM(forward)
+    CHECK_MEM(backward)
+
+    cdg_reader_reset(reader);
+
+    for (cdg_ts_t ts = BENCH_FRAME_PACKETS; ts <= packetCount; ts += BENCH_FRAME_PACKETS) {
+        start = bench_nanoseconds();
+        cdg_reader_seek(reader, ts);
+        forward[forwardCount++] = bench_nanoseconds() - start;
+    }
+
+    // Backward seeks from one random point to an earlier one
+    for (size_t i = 0; i < BENCH_BACKWARD_SEEKS && packetCount > 1; i++) {
+        cdg_ts_t from = 1 + bench_random(&seed) % (packetCount - 1);
+        cdg_ts_t to = bench_random(&seed) % from;
+
+        cdg_reader_seek(reader, from);
+
+        start = bench_nanoseconds();
+        cdg_reader_seek(reader, to);
+        backward[i] = bench_nanoseconds() - start;
+    }
+
+    bench_write_percentiles("forward_seek", forward, forwardCount);
+    printf(",\n");
+    bench_write_percentiles("backward_seek", backward, packetCount > 1 ? BENCH_BACKWARD_SEEKS : 0);
+    printf("\n    }");
+
+    free(backward);
+    free(forward);
+    cdg_reader_free(reader);
+
+    return 1;
+}
+
+static int bench_mp3(const char *path) {
+    mp3dec_ex_t mp3d;
+    mp3d_sample_t *buf = (mp3d_sample_t *) malloc(sizeof(mp3d_sample_t) * 16384);
+    const uint8_t *data;
+    size_t size;
+    uint64_t samples = 0;
+    uint64_t start, elapsed;
+    size_t count;
+    double audioSeconds;
+
+    CHECK_MEM(buf)
+
+    if (!map_file(path, &data, &size)) {
+        fprintf(stderr, "%s: failed to open file\n", path);
+        free(buf);
+        return 0;
+    }
+
+    start = bench_nanoseconds();
+
+    if (mp3dec_ex_open_buf(&mp3d, data, size, MP3D_SEEK_TO_SAMPLE) < 0) {
+        fprintf(stderr, "%s: failed to load MP3 file\n", path);
+        unmap_file(data, size);
+        free(buf);
+        return 0;
+    }
+
+    while ((count = mp3dec_ex_read(&mp3d, buf, 16384)) > 0) {
+        samples += count;
+    }
+
+    elapsed = bench_nanoseconds() - start;
+    audioSeconds = mp3d.info.hz && mp3d.info.channels ? (double) samples / mp3d.info.channels / mp3d.info.hz : 0;
+
+    printf("{\"name\": ");
+    bench_write_string(path);
+    printf(", \"bytes\": %zu, \"sample_rate\": %d, \"channels\": %d, \"audio_seconds\": %.3f, \"seconds\": %.6f, "
+           "\"mb_per_second\": %.2f, \"realtime_factor\": %.1f}",
+           size, mp3d.info.hz, mp3d.info.channels, audioSeconds, elapsed / 1e9,
+           size / (elapsed / 1e9) / 1e6, audioSeconds / (elapsed / 1e9));
+
+    mp3dec_ex_close(&mp3d);
+    unmap_file(data, size);
+    free(buf);
+
+    return 1;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-t seconds] [-m mp3] [cdg...]\n", name);
+    fprintf(stderr, "  -t  minimum time to spend on each measurement, default %.2f\n", BENCH_DEFAULT_SECONDS);
+    fprintf(stderr, "  -m  also measure MP3 decoding\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *mp3Path = NULL;
+    double minSeconds = BENCH_DEFAULT_SECONDS;
+    char *songPath;
+    int songCount = 0;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:m:h")) != -1) {
+        switch (opt) {
+            case 't':
+                if ((minSeconds = strtod(optarg, NULL)) <= 0) {
+                    fprintf(stderr, "invalid time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                mp3Path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt != 'h';
+        }
+    }
+
+    if ((songPath = bench_make_song()) == NULL) {
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"version\": 2,\n");
+    printf("  \"process_insn\": [\n");
+
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        bench_process_insn(&mixes[i], minSeconds);
+        printf("%s\n", i + 1 < sizeof(mixes) / sizeof(mixes[0]) ? "," : "");
+    }
+
+    printf("  ],\n");
+    printf("  \"per_pixel_reference\": [\n");
+
+    bench_per_pixel_tiles(&mixes[BENCH_PACKET_TILE_BLOCK], minSeconds);
+    printf(",\n");
+    bench_per_pixel_tiles(&mixes[BENCH_PACKET_TILE_BLOCK_XOR], minSeconds);
+    printf("\n");
+
+    printf("  ],\n");
+    printf("  \"songs\": [");
+
+    songCount += bench_song(songPath, "synthetic", minSeconds, songCount == 0);
+
+    for (int i = optind; i < argc; i++) {
+        if (bench_song(argv[i], argv[i], minSeconds, songCount == 0)) {
+            songCount++;
+        } else {
+            failures++;
+        }
+    }
+
+    printf("\n  ],\n");
+    printf("  \"mp3\": ");
+
+    if (mp3Path == NULL || !bench_mp3(mp3Path)) {
+        printf("null");
+        failures += mp3Path != NULL;
+    }
+
+    printf("\n}\n");
+
+    unlink(songPath);
+    free(songPath);
+
+    return failures > 0;
+}
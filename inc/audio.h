@@ -2,27 +2,62 @@
 #define _AUDIO_H_INCLUDED
 #include <stdio.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <portaudio.h>
 
 #include "util.h"
 #include "minimp3_ex.h"
 
-/* Represents a buffer of PCM data */
-struct pcm_buffer {
-    size_t size;
-    size_t capacity;
-    size_t index;
-
-    uint16_t *buffer;
+/* Size of the PCM ring buffer in samples (channels included) - must be a power of two */
+#define PCM_RING_SIZE (64 * 1024)
+
+/*
+ * Exact conversions between milliseconds and frames (one sample per channel) at HZ, rounding down.
+ * Positions are kept in whole frames so that a seek can never land between the channels of one.
+ */
+#define AUDIO_MS_TO_FRAMES(MS, HZ) ((uint64_t) (MS) * (uint64_t) (HZ) / 1000)
+#define AUDIO_FRAMES_TO_MS(FRAMES, HZ) ((uint64_t) (FRAMES) * 1000 / (uint64_t) (HZ))
+
+/* Maximum number of samples the decoder thread decodes at once */
+#define PCM_DECODE_CHUNK 4096
+
+/*
+ * Lock-free single-producer/single-consumer ring of decoded PCM data. The decoder thread is the
+ * only writer of the producer fields and the PortAudio callback is the only writer of the consumer
+ * fields, so the callback never has to block or allocate.
+ *
+ * A seek is published by the producer as a flush: the ring index its post-seek data starts at and
+ * the file position of that data, guarded by a sequence counter that is odd while they are being
+ * written. The consumer jumps its read index forward to the flush index when it sees a new one.
+ */
+struct pcm_ring {
+    /* Producer - written by the decoder thread */
+    size_t write CACHE_ALIGNED;   /* Total samples produced */
+    int eof;                      /* Everything up to `write` is the end of the file */
+    unsigned int flush_seq;
+    size_t flush_index;
+    int flush_position;           /* In samples */
+
+    /* Consumer - written by the PortAudio callback */
+    size_t read CACHE_ALIGNED;    /* Total samples consumed */
+    unsigned int seen_flush_seq;
+    size_t underruns;             /* Callbacks that ran out of data before the end of the file */
+    size_t underrun_samples;      /* Samples of silence played because of them */
+
+    /* Posted by the callback when it frees up room, and on seek or stop */
+    sem_t wakeup CACHE_ALIGNED;
+
+    int16_t buffer[PCM_RING_SIZE] CACHE_ALIGNED;
 };
 
 struct audio_state {
     /* PCM data buffer */
-    struct pcm_buffer *pcm;
+    struct pcm_ring *ring;
 
     /* MP3 decoding stuff */
-    mp3dec_t mp3d;
-    mp3dec_file_info_t mp3_file_info;
+    const uint8_t *mp3_data; /* Read-only mapping of the whole MP3 file, decoded in place */
+    size_t mp3_size;
+    mp3dec_ex_t mp3d;
 
     /* PortAudio stuff */
     PaStream *stream;
@@ -30,7 +65,21 @@ struct audio_state {
     /* The thread that the MP3 is being played on */
     pthread_t thread;
 
-    ATOMIC_INT timestamp; /* In milliseconds */
+    /* The thread that decodes the MP3 into the ring buffer */
+    pthread_t decoder_thread;
+    ATOMIC_INT decoding;
+
+    /*
+     * Playback clock, published by the PortAudio callback under clock_seq (odd while it's being
+     * written). Positions are in frames, i.e. samples per channel. See audio_state_get_clock().
+     */
+    unsigned int clock_seq;
+    int64_t clock_dac_ns;  /* CLOCK_MONOTONIC time at which clock_frame reaches the DAC */
+    int64_t clock_frame;   /* First frame of the latest buffer, or -1 before playback starts */
+    int64_t clock_floor;   /* Never read lower than this, so the clock doesn't step back between buffers... */
+    int64_t clock_limit;   /* ...or higher than this, the end of what has been handed to the DAC */
+
+    ATOMIC_INT position;  /* In samples, of the next sample to be played */
     ATOMIC_INT seek_to;   /* In samples */
 };
 
@@ -40,13 +89,23 @@ struct audio_state *audio_state_new(void);
 /* Free an audio state */
 void audio_state_free(struct audio_state *state);
 
-/* Load an MP3 file into the audio state. This decodes the whole file. */
-int audio_state_load_file(struct audio_state *state, const char *path, MP3D_PROGRESS_CB progress_cb);
+/* Open an MP3 file for playback. Decoding happens on the fly once playback starts. */
+int audio_state_load_file(struct audio_state *state, const char *path);
 
 /* Returns a value in milliseconds since the start of the MP3 */
 int audio_state_get_pos(struct audio_state *state);
 
-/* Seek to a position in milliseconds */
+/*
+ * Returns the frame currently coming out of the speakers, or -1 if playback hasn't started.
+ * Interpolated between audio callbacks from the DAC timing PortAudio gives each of them, so it
+ * moves smoothly rather than in buffer-sized steps, and never goes backward except on a seek.
+ */
+int64_t audio_state_get_clock(struct audio_state *state);
+
+/* Returns the sample rate of the loaded MP3, in Hz */
+int audio_state_get_sample_rate(struct audio_state *state);
+
+/* Seek to a position in milliseconds, past the end of the MP3 being clamped to it */
 void audio_state_seek(struct audio_state *state, uint32_t ms);
 
 /* Start playback - returns once playback is complete or an error occurs */
@@ -0,0 +1,36 @@
+#ifndef _BACKGROUND_H_INCLUDED
+#define _BACKGROUND_H_INCLUDED
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * An image or video to show through the transparent parts of the CDG screen. Either is read from
+ * binary PPM (P6, 8 bits per channel): a still image is a single PPM, and a video is any number of
+ * equally sized PPMs back to back, as written by `cdg-render -f ppm` or `ffmpeg -c:v ppm -f image2pipe`.
+ * The file is mapped, and frames are handed out straight from the mapping.
+ */
+struct background {
+    const uint8_t *data;
+    size_t size;
+
+    int width;
+    int height;
+
+    /* Start of each frame's pixels */
+    const uint8_t **frames;
+    size_t frame_count;
+};
+
+/* Frame rate for videos, unless overridden by CDG_BACKGROUND_FPS */
+#define BACKGROUND_DEFAULT_FPS 30
+
+/* Map and check a background file. Returns NULL if it can't be read or isn't a usable PPM. */
+struct background *background_load(const char *path);
+
+void background_free(struct background *background);
+
+/* Returns frame `index` as width * height packed RGB pixels, looping back to the start of a video */
+const uint8_t *background_get_frame(const struct background *background, size_t index);
+
+#endif // _BACKGROUND_H_INCLUDED
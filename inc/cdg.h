@@ -2,6 +2,7 @@
 #define _CDG_H_INCLUDED
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #define CDG_INSN_INVALID             -2
@@ -16,12 +17,35 @@
 #define CDG_INSN_LOAD_COLOR_TABLE_08 31
 #define CDG_INSN_TILE_BLOCK_XOR      38
 
-#define ARRAY_INDEX(X, Y) (((Y) * 300) + (X))
-// 300 frames per second
-#define MS_TO_CDG_FRAME_COUNT(X) ((int)(((float)(X) * 300.0f) / 1000.0f))
-#define CDG_FRAME_COUNT_TO_MS(X) (((float)(X) * 1000.0f) / 300.0f)
+#define CDG_SCREEN_WIDTH  300
+#define CDG_SCREEN_HEIGHT 216
+#define CDG_TILE_WIDTH    6
+#define CDG_TILE_HEIGHT   12
 
-typedef unsigned long cdg_ts_t;
+#define CDG_TILE_COLUMNS  (CDG_SCREEN_WIDTH / CDG_TILE_WIDTH)
+#define CDG_TILE_ROWS     (CDG_SCREEN_HEIGHT / CDG_TILE_HEIGHT)
+
+/* One byte per pixel, holding a color table index */
+#define CDG_FRAMEBUFFER_SIZE (CDG_SCREEN_WIDTH * CDG_SCREEN_HEIGHT)
+/* Two pixels per byte, left-most pixel in the high nibble */
+#define CDG_PACKED_FRAMEBUFFER_SIZE (CDG_FRAMEBUFFER_SIZE / 2)
+
+#define ARRAY_INDEX(X, Y) (((Y) * CDG_SCREEN_WIDTH) + (X))
+/* Timestamps count subchannel packets, of which there are always 300 per second */
+#define CDG_PACKETS_PER_SECOND 300
+
+typedef uint64_t cdg_ts_t;
+
+/*
+ * Exact conversions to and from timestamps, in integer arithmetic so they don't drift however
+ * long the song. Timestamps round down: each is the packet being played at the given time.
+ */
+#define CDG_MS_TO_TS(MS) ((cdg_ts_t) (MS) * CDG_PACKETS_PER_SECOND / 1000)
+#define CDG_TS_TO_MS(TS) ((uint64_t) (TS) * 1000 / CDG_PACKETS_PER_SECOND)
+
+/* The same, for positions in audio frames at HZ. CDG_TS_TO_FRAMES() gives a packet's first frame. */
+#define CDG_FRAMES_TO_TS(FRAMES, HZ) ((cdg_ts_t) (FRAMES) * CDG_PACKETS_PER_SECOND / (uint64_t) (HZ))
+#define CDG_TS_TO_FRAMES(TS, HZ) (((uint64_t) (TS) * (uint64_t) (HZ) + CDG_PACKETS_PER_SECOND - 1) / CDG_PACKETS_PER_SECOND)
 
 #pragma pack(push, 1)
 struct subchannel_packet {
@@ -57,14 +81,24 @@ struct cdg_insn_tile_block {
 
 struct cdg_insn_scroll {
     uint8_t color;       // only lower 4 bits are used
-    uint8_t h_scroll;    // only lower 6 bits are used
+    uint8_t h_scroll;    // only lower 6 bits are used, see CDG_SCROLL_COMMAND() and CDG_SCROLL_OFFSET()
     uint8_t v_scroll;    // only lower 6 bits are used
     uint8_t _filler[13];
 };
 
-/* The documentation I have doesn't specify the contents of this instruction */
+/* Bits 4-5 of h_scroll and v_scroll say which way to shift the screen by a whole tile... */
+#define CDG_SCROLL_COMMAND(X) (((X) >> 4) & 0x3)
+#define CDG_SCROLL_NONE       0
+#define CDG_SCROLL_FORWARD    1 // Right, or down
+#define CDG_SCROLL_BACKWARD   2 // Left, or up
+
+/* ...and the rest give the fine offset, in pixels: 0-5 across (bits 0-2) and 0-11 down (bits 0-3) */
+#define CDG_SCROLL_H_OFFSET(X) ((X) & 0x7)
+#define CDG_SCROLL_V_OFFSET(X) ((X) & 0xF)
+
+/* How see-through each color is, from 0 (opaque) to 63 (fully transparent), over whatever is behind the screen */
 struct cdg_insn_define_transparent {
-    uint8_t _filler[16];
+    uint8_t transparency[16]; // only lower 6 bits are used
 };
 
 struct cdg_insn_load_color_table {
@@ -72,35 +106,153 @@ struct cdg_insn_load_color_table {
 };
 #pragma pack(pop)
 
+/* Packets between periodic keyframes - one second of playback */
+#define CDG_DEFAULT_SNAPSHOT_INTERVAL 300
+
+/* A full snapshot of the decoder state, taken after `timestamp` packets have been processed */
 struct cdg_keyframe {
     cdg_ts_t timestamp;      // subchannel packet count
     int color_table[16];
-    uint8_t clear_color;
+    uint32_t data_offset;    // Framebuffer snapshot in cdg_keyframe_list.data, see cdg.c for the encoding
+    uint32_t data_size;
+    uint8_t h_offset;        // Fine scroll offsets
+    uint8_t v_offset;
+    uint8_t transparency[16];
+    uint8_t _padding[6];     // Keyframes are written to index files as they are, so keep this zeroed
 };
 
 struct cdg_keyframe_list {
     size_t count;
+    size_t capacity;
     struct cdg_keyframe *keyframes;
+
+    /* Encoded framebuffer snapshots - keyframes with identical screens share the same data */
+    size_t data_size;
+    size_t data_capacity;
+    uint8_t *data;
+
+    /* If set, the list was loaded from an index and points into this read-only mapping of it */
+    const uint8_t *mapping;
+    size_t mapping_size;
 };
 
+/* A rectangle of the framebuffer, in pixels */
+struct cdg_rect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/* Enough rectangles for the worst case of every other tile being dirty */
+#define CDG_MAX_DIRTY_RECTS (CDG_TILE_ROWS * ((CDG_TILE_COLUMNS + 1) / 2))
+
 struct cdg_state {
     cdg_ts_t ts; /* Current timestamp (in subchannel packets) */
     int color_table[16];
-    unsigned int framebuffer[300 * 216];
+    uint8_t transparency[16]; /* Set by DEF_TRANSPARENT, 0 (opaque) to 63 - see cdg_state_palette_to_rgba() */
+    int palette_dirty; /* Color table or transparency changed since the last cdg_state_take_palette() */
+
+    /* Framebuffer areas changed since the last cdg_state_take_dirty_rects() */
+    uint64_t dirty_tiles[CDG_TILE_ROWS]; /* Bit N of row R is tile (N, R) */
+    int dirty_all;
+    uint8_t framebuffer[CDG_FRAMEBUFFER_SIZE]; /* Color table indices, see cdg_state_get_framebuffer() */
+
+    /*
+     * Fine scroll offsets, set by SCROLL_PRESET and SCROLL_COPY. The screen shows the framebuffer
+     * moved left by h_offset (0-5) and up by v_offset (0-11) pixels, wrapping around at the edges.
+     */
+    int h_offset;
+    int v_offset;
+};
+
+/* What, if anything, is wrong with a packet - see cdg_packet_check() */
+enum cdg_packet_status {
+    CDG_PACKET_OK,
+    CDG_PACKET_NOT_CDG,   /* Not CD+G graphics at all, e.g. empty subchannel data - perfectly normal */
+    CDG_PACKET_UNKNOWN,   /* An instruction that isn't in the CD+G spec, which is ignored */
+    CDG_PACKET_MALFORMED  /* A known instruction with fields out of range, which is ignored or clamped */
+};
+
+/*
+ * Problems found while decoding a file, counted by instruction byte. The reader keeps count rather
+ * than printing anything, so decoding never does I/O - see cdg_diagnostics_log().
+ */
+struct cdg_diagnostics {
+    uint32_t unknown[256];
+    uint32_t malformed[256];
+    uint32_t end_of_stream; /* Seeks that ran into the end of the file */
+
+    /* Packets before this have been checked - packets replayed after seeking back aren't counted again */
+    cdg_ts_t checked;
 };
 
 struct cdg_reader {
     int eof;
-    uint8_t *buffer;
+    const uint8_t *buffer;   /* Read-only mapping of the whole file */
     size_t buffer_size;
     size_t buffer_index;
 
     struct cdg_state state;
     struct cdg_keyframe_list keyframes;
+
+    /* Maximum number of packets between keyframes, or 0 to only keyframe at MEMORY_PRESET */
+    cdg_ts_t snapshot_interval;
+
+    /*
+     * Filled in as the file is decoded, by cdg_reader_build_keyframe_list() and cdg_reader_seek(),
+     * or restored from the index entry that a keyframe list is loaded from
+     */
+    struct cdg_diagnostics diagnostics;
 };
 
 /* Process an instruction and update the state */
-int cdg_state_process_insn(struct cdg_state *state, struct subchannel_packet *pkt);
+int cdg_state_process_insn(struct cdg_state *state, const struct subchannel_packet *pkt);
+
+/* Check whether a packet is something cdg_state_process_insn() understands, without decoding it */
+enum cdg_packet_status cdg_packet_check(const struct subchannel_packet *pkt);
+
+/* Returns the number of unknown and malformed packets counted */
+uint32_t cdg_diagnostics_problem_count(const struct cdg_diagnostics *diagnostics);
+
+/* Write a line to `fp` for each kind of problem counted, prefixed with `name` - normally the file's path */
+void cdg_diagnostics_log(const struct cdg_diagnostics *diagnostics, const char *name, FILE *fp);
+
+/* Returns the color table index of the pixel at (x, y) */
+uint8_t cdg_state_get_pixel(const struct cdg_state *state, int x, int y);
+
+/* Returns the framebuffer as CDG_SCREEN_HEIGHT rows of CDG_SCREEN_WIDTH color table indices, without the scroll offsets */
+const uint8_t *cdg_state_get_framebuffer(const struct cdg_state *state);
+
+/* Pack the framebuffer into CDG_PACKED_FRAMEBUFFER_SIZE bytes of 4-bit indices */
+void cdg_state_pack_framebuffer(const struct cdg_state *state, uint8_t *out);
+
+/* Replace the framebuffer with one packed by cdg_state_pack_framebuffer() */
+void cdg_state_unpack_framebuffer(struct cdg_state *state, const uint8_t *in);
+
+/* Copy the screen as it's shown, with the scroll offsets applied, as CDG_FRAMEBUFFER_SIZE color table indices */
+void cdg_state_get_screen(const struct cdg_state *state, uint8_t *out);
+
+/* Convert the screen as it's shown to CDG_FRAMEBUFFER_SIZE * 3 bytes of packed 8-bit RGB, ignoring transparency */
+void cdg_state_to_rgb(const struct cdg_state *state, uint8_t *out);
+
+/* Convert the color table to 16 RGBA texels of 8 bits per channel, with alpha 0 for fully transparent colors */
+void cdg_state_palette_to_rgba(const struct cdg_state *state, uint8_t *out);
+
+/*
+ * If the color table changed since the last call, convert it with cdg_state_palette_to_rgba(),
+ * mark it clean and return 1. Otherwise returns 0 and leaves `out` alone.
+ */
+int cdg_state_take_palette(struct cdg_state *state, uint8_t *out);
+
+/* Returns nonzero if any of the framebuffer changed since the last cdg_state_take_dirty_rects() */
+int cdg_state_has_dirty_rects(const struct cdg_state *state);
+
+/*
+ * Collect the framebuffer areas changed since the last call into at most CDG_MAX_DIRTY_RECTS
+ * rectangles, and mark everything clean. Returns the number of rectangles.
+ */
+size_t cdg_state_take_dirty_rects(struct cdg_state *state, struct cdg_rect *rects);
 
 /* Initialize a CDG reader */
 struct cdg_reader *cdg_reader_new(void);
@@ -108,18 +260,53 @@ struct cdg_reader *cdg_reader_new(void);
 /* Free a CDG reader */
 void cdg_reader_free(struct cdg_reader *reader);
 
-/* Load a CDG file into a reader */
+/* Memory-map a CDG file into a reader. Pages are only read in as packets are used. */
 int cdg_reader_load_file(struct cdg_reader *reader, const char *path);
 
-/* Read a frame from the CDG buffer into the given packet */
-int cdg_reader_read_frame(struct cdg_reader *reader, struct subchannel_packet *outPkt);
+/* Returns the next packet in the file and advances past it, or NULL at the end of the file */
+const struct subchannel_packet *cdg_reader_next_packet(struct cdg_reader *reader);
+
+/* Returns the packet at the given timestamp without moving the reader, or NULL if out of range */
+const struct subchannel_packet *cdg_reader_packet_at(const struct cdg_reader *reader, cdg_ts_t ts);
 
 /* Reset the reader to the beginning of the CDG file */
 void cdg_reader_reset(struct cdg_reader *reader);
 
-/* Build a list of seek snapshots from the CDG reader */
+/*
+ * Decode the whole file and build a list of seek snapshots, taken at the start, at every
+ * MEMORY_PRESET and at least every reader->snapshot_interval packets.
+ */
 void cdg_reader_build_keyframe_list(struct cdg_reader *reader);
 
+/*
+ * Check a keyframe list that was built elsewhere, e.g. read back from an index file, for a file of
+ * `packetCount` packets: timestamps start at 0 and only go up, scroll offsets and transparencies are
+ * in range, and every framebuffer is inside the data and decodes to a whole screen. Returns 0 if
+ * the reader can't safely use it.
+ */
+int cdg_keyframe_list_check(const struct cdg_keyframe *keyframes, size_t count,
+                            const uint8_t *data, size_t dataSize, cdg_ts_t packetCount);
+
+/*
+ * Replace the reader's keyframe list with one built earlier, which lives in a mapping of an index
+ * file and has passed cdg_keyframe_list_check(). The reader uses it in place, and unmaps the
+ * mapping when it's done with it.
+ */
+void cdg_reader_use_mapped_keyframe_list(struct cdg_reader *reader, const uint8_t *mapping, size_t mappingSize,
+                                         const struct cdg_keyframe *keyframes, size_t count,
+                                         const uint8_t *data, size_t dataSize);
+
+/*
+ * Restore one of the reader's keyframes into a state of the caller's own, without touching the
+ * reader - so several threads can decode different parts of a song at once.
+ */
+void cdg_reader_restore_keyframe(const struct cdg_reader *reader, const struct cdg_keyframe *keyframe, struct cdg_state *state);
+
+/*
+ * Bring the reader state to the given timestamp, starting from the closest keyframe when that is
+ * nearer than the current position. Never replays more than reader->snapshot_interval packets
+ * when that is non-zero. Returns 1 if the framebuffer or color table may have changed.
+ */
 int cdg_reader_seek(struct cdg_reader *reader, cdg_ts_t ts);
 
 #endif // _CDG_H_INCLUDED
@@ -0,0 +1,142 @@
+#ifndef _CDG_INDEX_H_INCLUDED
+#define _CDG_INDEX_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cdg.h"
+
+/*
+ * Index files hold precomputed information about a library of CDG files - their keyframe lists,
+ * so they can be seeked without decoding them first, along with a summary of their contents.
+ *
+ * An index is a header, the entries, and a table of (path hash, entry offset) slots sorted by
+ * hash, so a song can be found without touching any other song's entry. Each entry is a
+ * cdg_index_entry followed by the file's absolute path, its keyframes and their framebuffer data,
+ * each padded to 8 bytes so that the keyframes can be used straight out of a mapping. Everything
+ * is in the writer's byte order, which readers check with `byte_order`, and any change to the
+ * layout bumps CDG_INDEX_VERSION.
+ */
+
+#define CDG_INDEX_MAGIC      "CDGINDEX"
+#define CDG_INDEX_VERSION    4
+#define CDG_INDEX_BYTE_ORDER 0x01020304
+
+/* Number of distinct CDG instruction codes */
+#define CDG_INSN_COUNT 64
+
+/* Round a size up to the alignment of everything in an index */
+#define CDG_INDEX_ALIGN(X) (((X) + 7) & ~(uint64_t) 7)
+
+struct cdg_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t entry_count;
+    uint64_t table_offset;
+};
+
+struct cdg_index_slot {
+    uint64_t path_hash;
+    uint64_t entry_offset;
+};
+
+/* Summary of a CDG file's contents */
+struct cdg_song_info {
+    uint64_t packet_count;
+    uint64_t duration_ms;
+    uint64_t checksum;                    /* 64-bit FNV-1a of the whole file */
+    uint32_t histogram[CDG_INSN_COUNT];   /* CDG graphics packets, by instruction */
+    uint32_t other_packets;               /* Packets that aren't CDG graphics, e.g. empty subchannel data */
+    uint32_t _padding;
+};
+
+struct cdg_index_entry {
+    uint64_t entry_size;     /* Including this structure and everything after it */
+
+    /* Identify the version of the file this was built from */
+    uint64_t file_size;
+    int64_t file_mtime_ns;
+
+    struct cdg_song_info info;
+    struct cdg_diagnostics diagnostics; /* As counted while building the keyframes */
+
+    cdg_ts_t snapshot_interval;
+    uint32_t path_length;    /* Not including the terminating null */
+    uint32_t keyframe_count;
+    uint64_t data_size;
+};
+
+/* A mapped index, checked by cdg_index_open() */
+struct cdg_index {
+    const uint8_t *data;
+    size_t size;
+    const struct cdg_index_slot *slots;
+    uint64_t entry_count;
+};
+
+/* 64-bit FNV-1a hash */
+uint64_t cdg_fnv1a(const uint8_t *data, size_t size);
+
+/* Summarize the file loaded into a reader */
+void cdg_song_info_compute(const struct cdg_reader *reader, struct cdg_song_info *info);
+
+/*
+ * Write an index header. Writers write a placeholder first, then rewrite it once the entry count
+ * and table offset are known.
+ */
+int cdg_index_write_header(FILE *fp, uint64_t entryCount, uint64_t tableOffset);
+
+/*
+ * Write an entry for the file loaded into a reader, whose keyframe list has been built. `path`
+ * should be absolute, and `fileSize` and `mtimeNs` should come from stat()ing the file.
+ */
+int cdg_index_write_entry(FILE *fp, const char *path, uint64_t fileSize, int64_t mtimeNs,
+                          const struct cdg_reader *reader, const struct cdg_song_info *info);
+
+/* Sort the slots for the entries written so far and write them out as the table */
+int cdg_index_write_table(FILE *fp, struct cdg_index_slot *slots, uint64_t count);
+
+/* Check the header and table of a mapped index. Returns 0 if it isn't a usable index. */
+int cdg_index_open(struct cdg_index *index, const uint8_t *data, size_t size);
+
+/* Returns the i-th entry in table order, or NULL if it's corrupt */
+const struct cdg_index_entry *cdg_index_get(const struct cdg_index *index, uint64_t i);
+
+/* Returns the entry for an absolute path, or NULL if there isn't one or its keyframes are damaged */
+const struct cdg_index_entry *cdg_index_find(const struct cdg_index *index, const char *path);
+
+/* The path, keyframes and framebuffer data stored after an entry */
+const char *cdg_index_entry_path(const struct cdg_index_entry *entry);
+const struct cdg_keyframe *cdg_index_entry_keyframes(const struct cdg_index_entry *entry);
+const uint8_t *cdg_index_entry_data(const struct cdg_index_entry *entry);
+
+/*
+ * Give a reader the keyframe list for the file at `path` from the index at `indexPath`, instead of
+ * building it. The index stays mapped for as long as the reader uses the list. Returns 0 if the
+ * index has no entry for the file, or the file has changed since.
+ */
+int cdg_reader_load_index(struct cdg_reader *reader, const char *indexPath, const char *path);
+
+/*
+ * Sidecars are single-entry indexes kept next to the files they describe, with the file's extension
+ * replaced by CDG_SIDECAR_EXTENSION - so "song.cdg" has "song.cdgidx".
+ */
+#define CDG_SIDECAR_EXTENSION ".cdgidx"
+
+/* Returns the sidecar path for a CDG file, which the caller must free */
+char *cdg_sidecar_path(const char *path);
+
+/* As cdg_reader_load_index(), from the sidecar of the file at `path` */
+int cdg_reader_load_sidecar(struct cdg_reader *reader, const char *path);
+
+/* Write the sidecar for the file at `path`, whose keyframe list the reader has built */
+int cdg_reader_save_sidecar(const struct cdg_reader *reader, const char *path);
+
+/*
+ * Give a reader a keyframe list for the file at `path`: mapped from its sidecar if it's up to date,
+ * otherwise built, with a new sidecar written for next time where the directory allows it.
+ */
+void cdg_reader_prepare_keyframe_list(struct cdg_reader *reader, const char *path);
+
+#endif // _CDG_INDEX_H_INCLUDED
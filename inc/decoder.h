@@ -0,0 +1,62 @@
+#ifndef _DECODER_H_INCLUDED
+#define _DECODER_H_INCLUDED
+
+#include <pthread.h>
+
+#include "cdg.h"
+#include "audio.h"
+#include "util.h"
+
+/* Set in cdg_decoder.middle while the frame there hasn't been taken by the render thread */
+#define CDG_DECODER_FRAME_FRESH 4
+
+/* What changed in a frame, relative to the last frame the render thread took */
+struct cdg_dirty_map {
+    uint64_t tiles[CDG_TILE_ROWS];
+    int all;
+    int palette;
+};
+
+/*
+ * Decodes CDG packets on its own thread, following the audio clock, so that long seeks never hold
+ * up rendering. Finished frames are handed to the render thread through a lock-free triple buffer:
+ * the decoder owns `back`, the render thread owns `front`, and they swap with `middle` atomically.
+ */
+struct cdg_decoder {
+    struct cdg_reader *reader;    /* Only touched by the decoder thread once it's started */
+    struct audio_state *audio;
+
+    struct cdg_state *frames[3];
+    int back;                     /* Decoder thread */
+    ATOMIC_INT middle;            /* Frame index, plus CDG_DECODER_FRAME_FRESH */
+    int front;                    /* Render thread */
+
+    /* Changes published in frames the render thread may not have taken */
+    struct cdg_dirty_map unconsumed;
+
+    pthread_t thread;
+    ATOMIC_INT running;
+};
+
+/* Construct a decoder for a reader that has been loaded and had its keyframe list built */
+struct cdg_decoder *cdg_decoder_new(struct cdg_reader *reader, struct audio_state *audio);
+
+/* Stop the decoder, if it's running, and free it - the reader and audio state are left alone */
+void cdg_decoder_free(struct cdg_decoder *decoder);
+
+/* Start the decoder thread */
+int cdg_decoder_start(struct cdg_decoder *decoder);
+
+/* Stop the decoder thread and wait for it to finish */
+void cdg_decoder_stop(struct cdg_decoder *decoder);
+
+/* Returns nonzero if there's a frame the render thread hasn't taken yet */
+int cdg_decoder_has_frame(struct cdg_decoder *decoder);
+
+/*
+ * Take the latest frame, if there's a new one, or return NULL. The frame's dirty map covers every
+ * change since the last frame taken, and it belongs to the render thread until the next call.
+ */
+struct cdg_state *cdg_decoder_take_frame(struct cdg_decoder *decoder);
+
+#endif // _DECODER_H_INCLUDED
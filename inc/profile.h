@@ -0,0 +1,41 @@
+#ifndef _PROFILE_H_INCLUDED
+#define _PROFILE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Optional instrumentation of the decoder, built in with -DCDG_PROFILE (`make profile`) and compiled
+ * out otherwise. It counts every instruction processed and the time spent on it, by instruction
+ * code, and times every seek. The totals are written as JSON when the program exits, and whenever
+ * it receives SIGUSR1, to the file named by CDG_PROFILE_OUTPUT or otherwise stderr.
+ *
+ * Each thread keeps its own counters, so instrumented threads never contend with each other.
+ */
+
+/* Instruction slots are indexed by instruction code, plus one for packets that aren't CDG graphics */
+#define PROFILE_INSN_SLOTS   257
+#define PROFILE_INSN_NOT_CDG 256
+
+/* Seek latencies are bucketed by powers of two: bucket i > 0 counts seeks of [2^i, 2^(i+1)) nanoseconds */
+#define PROFILE_SEEK_BUCKETS 40
+
+#ifdef CDG_PROFILE
+/* Start the signal handling thread and register the dump at exit. Call before creating any threads. */
+#define PROFILE_INIT() profile_init()
+#else
+#define PROFILE_INIT() ((void) 0)
+#endif
+
+void profile_init(void);
+
+/* Cheapest available timestamp - the TSC on x86, otherwise nanoseconds */
+uint64_t profile_ticks(void);
+uint64_t profile_nanoseconds(void);
+
+void profile_record_insn(int slot, uint64_t ticks);
+void profile_record_seek(uint64_t nanoseconds, uint64_t packets, int jumped);
+
+/* Write the totals of every thread so far as JSON. Returns 0 if the output couldn't be written. */
+int profile_dump(void);
+
+#endif // _PROFILE_H_INCLUDED
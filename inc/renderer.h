@@ -0,0 +1,73 @@
+#ifndef _RENDERER_H_INCLUDED
+#define _RENDERER_H_INCLUDED
+
+#include <GL/glew.h>
+
+#include "cdg.h"
+
+/* Number of pixel buffers that framebuffer uploads rotate through */
+#define RENDERER_PBO_COUNT 3
+
+struct renderer_pbo {
+    GLuint buffer;
+    uint8_t *mapping; /* Persistent mapping, if any */
+    GLsync fence;     /* Signaled once the GPU is done with the last upload from this buffer */
+};
+
+/* Draws the CDG screen with OpenGL - needs a current context */
+struct renderer {
+    /* Set if the OpenGL 3.3 core profile shaders are in use, rather than the 3.0 fallback */
+    int core_profile;
+
+    GLuint program;
+    GLint palette_location;
+    GLint framebuffer_location;
+    GLint screen_size_location;
+    GLint scroll_offset_location;
+    GLint background_location;
+
+    /* Fine scroll offsets last given to the shader */
+    int h_offset;
+    int v_offset;
+
+    /* A single triangle covering the whole viewport */
+    GLuint vao;
+    GLuint vbo;
+
+    GLuint framebuffer_texture; /* Texture unit 0 */
+    GLuint palette_texture;     /* Texture unit 1 - only re-uploaded when the color table changes */
+    GLuint background_texture;  /* Texture unit 2 - shows through transparent colors, black unless set */
+    int background_width;
+    int background_height;
+
+    /* Framebuffer uploads go through these in turn */
+    struct renderer_pbo pbos[RENDERER_PBO_COUNT];
+    size_t pbo_index;
+    int persistent; /* Set if the buffers are persistently mapped */
+};
+
+/* Set up the shaders, geometry and textures, starting from the given CDG state */
+struct renderer *renderer_new(const struct cdg_state *state);
+
+/* Free a renderer and its OpenGL objects */
+void renderer_free(struct renderer *renderer);
+
+/*
+ * Upload whatever changed in the CDG state since the last update. Returns 0 if the upload had to
+ * be put off because the GPU is still busy with earlier ones - the changes are kept for next time.
+ */
+int renderer_update(struct renderer *renderer, struct cdg_state *state);
+
+/*
+ * Show an image, width * height packed 8-bit RGB pixels, through the transparent parts of the screen.
+ * It's stretched to fit, and blended in by the shader. Call again with each frame of a video.
+ */
+void renderer_set_background(struct renderer *renderer, int width, int height, const uint8_t *rgb);
+
+/* Draw the CDG screen into the current viewport */
+void renderer_draw(struct renderer *renderer);
+
+/* Handle the window being resized */
+void renderer_resize(struct renderer *renderer, int width, int height);
+
+#endif // _RENDERER_H_INCLUDED
@@ -3,28 +3,63 @@
 
 #include <GL/glew.h>
 
-#define CDG_VERTEX_SHADER_SOURCE "#version 130\n \
+/*
+ * Both shader pairs draw a single triangle that covers the whole of clip space, given as
+ * `position`, and map it onto CDG pixel coordinates (y pointing down) using cdgScreenSize.
+ * Each pixel is read cdgScrollOffset further into the framebuffer, wrapping around, so fine
+ * scrolling never touches the texture. Its color table index is then looked up in the 16x1
+ * cdgPalette texture, whose alpha blends it over the cdgBackground image.
+ */
+
+/* OpenGL 3.3 core profile */
+#define CDG_VERTEX_SHADER_SOURCE "#version 330 core\n \
+layout(location = 0) in vec2 position; \
+uniform vec2 cdgScreenSize; \
+out vec2 vertexCoord; \
+void main() { \
+    vertexCoord = vec2(position.x + 1.0, 1.0 - position.y) * 0.5 * cdgScreenSize; \
+    gl_Position = vec4(position, 0.0, 1.0); \
+}"
+
+#define CDG_FRAGMENT_SHADER_SOURCE "#version 330 core\n \
+uniform sampler2D cdgPalette; \
+uniform usampler2D cdgFramebuffer; \
+uniform ivec2 cdgScrollOffset; \
+uniform sampler2D cdgBackground; \
+uniform vec2 cdgScreenSize; \
+in vec2 vertexCoord; \
+out vec4 fragColor; \
+void main() { \
+    ivec2 index = (ivec2(vertexCoord.x, vertexCoord.y) + cdgScrollOffset) % textureSize(cdgFramebuffer, 0); \
+    int colorIndex = int(texelFetch(cdgFramebuffer, index, 0).r); \
+    vec4 color = texelFetch(cdgPalette, ivec2(colorIndex, 0), 0); \
+    vec3 background = texture(cdgBackground, vertexCoord / cdgScreenSize).rgb; \
+    fragColor = vec4(mix(background, color.rgb, color.a), 1.0); \
+}"
+
+/* Fallback for OpenGL 3.0 compatibility contexts */
+#define CDG_COMPAT_VERTEX_SHADER_SOURCE "#version 130\n \
+in vec2 position; \
+uniform vec2 cdgScreenSize; \
 out vec2 vertexCoord; \
 void main() { \
-    vertexCoord = gl_Vertex.xy; \
-    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex; \
+    vertexCoord = vec2(position.x + 1.0, 1.0 - position.y) * 0.5 * cdgScreenSize; \
+    gl_Position = vec4(position, 0.0, 1.0); \
 }"
 
-#define CDG_FRAGMENT_SHADER_SOURCE "#version 130\n \
-#extension GL_EXT_gpu_shader4 : enable\n \
-uniform int[16] cdgColorMap; \
-uniform sampler2D cdgFramebuffer; \
+#define CDG_COMPAT_FRAGMENT_SHADER_SOURCE "#version 130\n \
+uniform sampler2D cdgPalette; \
+uniform usampler2D cdgFramebuffer; \
+uniform ivec2 cdgScrollOffset; \
+uniform sampler2D cdgBackground; \
+uniform vec2 cdgScreenSize; \
 in vec2 vertexCoord; \
 void main() { \
-    ivec2 index = ivec2(vertexCoord.x, vertexCoord.y); \
-    int colorIndex = int(texelFetch(cdgFramebuffer, index, 0).r * 255); \
-    int rgb = cdgColorMap[colorIndex]; \
-    gl_FragColor = vec4( \
-        float((rgb >> 16) & 0xFF) / 255.0, \
-        float((rgb >> 8) & 0xFF) / 255.0, \
-        float((rgb & 0xFF)) / 255.0, \
-        1.0 \
-    ); \
+    ivec2 index = (ivec2(vertexCoord.x, vertexCoord.y) + cdgScrollOffset) % textureSize(cdgFramebuffer, 0); \
+    int colorIndex = int(texelFetch(cdgFramebuffer, index, 0).r); \
+    vec4 color = texelFetch(cdgPalette, ivec2(colorIndex, 0), 0); \
+    vec3 background = texture(cdgBackground, vertexCoord / cdgScreenSize).rgb; \
+    gl_FragColor = vec4(mix(background, color.rgb, color.a), 1.0); \
 }"
 
 GLuint load_shader_program(const char *vertexSource, const char *fragmentSource);
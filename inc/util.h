@@ -1,16 +1,39 @@
 #ifndef _UTIL_H_INCLUDED
 #define _UTIL_H_INCLUDED
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #define ATOMIC_INT int
 #define ATOMIC_INT_GET(I) (__atomic_load_n(&(I), __ATOMIC_RELAXED))
 #define ATOMIC_INT_SET(I, V) __atomic_store_n(&(I), (V), __ATOMIC_RELAXED)
+/* Sets I to V if it still holds E - E must be an lvalue, and is updated with the current value on failure */
+#define ATOMIC_INT_CAS(I, E, V) (__atomic_compare_exchange_n(&(I), &(E), (V), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+
+/* Stores V in I and returns what it held before */
+#define ATOMIC_INT_EXCHANGE(I, V) (__atomic_exchange_n(&(I), (V), __ATOMIC_ACQ_REL))
+
+/* Adds V to I and returns what it held before */
+#define ATOMIC_INT_FETCH_ADD(I, V) (__atomic_fetch_add(&(I), (V), __ATOMIC_RELAXED))
+
+/* Explicitly ordered accesses, for data shared without locks */
+#define ATOMIC_LOAD_RELAXED(X) (__atomic_load_n(&(X), __ATOMIC_RELAXED))
+#define ATOMIC_LOAD_ACQUIRE(X) (__atomic_load_n(&(X), __ATOMIC_ACQUIRE))
+#define ATOMIC_STORE_RELAXED(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELAXED)
+#define ATOMIC_STORE_RELEASE(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+#define ATOMIC_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define ATOMIC_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+/* Keeps data written by different threads on different cache lines */
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
 
 #define UNUSED(X) (void)(X)
 #define CHECK_MEM(X) if ((X) == NULL) { fprintf(stderr, "[%s] at line %d: failed to allocate memory\n", __FILE__, __LINE__); exit(1); }
 
 int read_file(const char *path, char **buf, unsigned long *size);
+int map_file(const char *path, const uint8_t **buf, size_t *size);
+void unmap_file(const uint8_t *buf, size_t size);
 void backup_and_close_stdout_stderr(void);
 void restore_stdout_stderr(void);
 
@@ -1,23 +1,25 @@
 // !!! This isn't the actual shader used, you need to change shaders.h to reflect changes to this!
-#version 130
-#extension GL_EXT_gpu_shader4 : enable
+#version 330 core
 
-uniform int[16] cdgColorMap;
-uniform sampler2D cdgFramebuffer;
+uniform sampler2D cdgPalette;       // 16x1 RGBA
+uniform usampler2D cdgFramebuffer;  // Color table indices
+uniform ivec2 cdgScrollOffset;      // Fine scroll offset, in pixels
+uniform sampler2D cdgBackground;    // Shows through transparent colors
+uniform vec2 cdgScreenSize;         // Size of the CDG screen in pixels
 
 // Coordinate of the vertex in the framebuffer
 in vec2 vertexCoord;
 
+out vec4 fragColor;
+
 void main() {
-    ivec2 index = ivec2(vertexCoord.x, vertexCoord.y);
-    int colorIndex = int(texelFetch(cdgFramebuffer, index, 0).r * 255);
+    // Scrolling moves the picture left and up, wrapping around
+    ivec2 index = (ivec2(vertexCoord.x, vertexCoord.y) + cdgScrollOffset) % textureSize(cdgFramebuffer, 0);
+    int colorIndex = int(texelFetch(cdgFramebuffer, index, 0).r);
 
-    int rgb = cdgColorMap[colorIndex];
+    vec4 color = texelFetch(cdgPalette, ivec2(colorIndex, 0), 0);
+    vec3 background = texture(cdgBackground, vertexCoord / cdgScreenSize).rgb;
 
-    gl_FragColor = vec4(
-        float((rgb >> 16) & 0xFF) / 255.0,
-        float((rgb >> 8) & 0xFF) / 255.0,
-        float((rgb & 0xFF)) / 255.0,
-        1.0
-    );
+    // Transparent colors let the background through
+    fragColor = vec4(mix(background, color.rgb, color.a), 1.0);
 }
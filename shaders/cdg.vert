@@ -1,10 +1,16 @@
 // !!! This isn't the actual shader used, you need to change shaders.h to reflect changes to this!
-#version 130
+#version 330 core
+
+// Corner of a triangle that covers the whole of clip space
+layout(location = 0) in vec2 position;
+
+// Size of the CDG screen in pixels
+uniform vec2 cdgScreenSize;
 
 out vec2 vertexCoord;
 
 void main() {
-    vertexCoord = gl_Vertex.xy;
+    vertexCoord = vec2(position.x + 1.0, 1.0 - position.y) * 0.5 * cdgScreenSize;
 
-    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
-}
\ No newline at end of file
+    gl_Position = vec4(position, 0.0, 1.0);
+}
@@ -0,0 +1,24 @@
+// !!! This isn't the actual shader used, you need to change shaders.h to reflect changes to this!
+// Fallback for OpenGL 3.0 compatibility contexts
+#version 130
+
+uniform sampler2D cdgPalette;       // 16x1 RGBA
+uniform usampler2D cdgFramebuffer;  // Color table indices
+uniform ivec2 cdgScrollOffset;      // Fine scroll offset, in pixels
+uniform sampler2D cdgBackground;    // Shows through transparent colors
+uniform vec2 cdgScreenSize;         // Size of the CDG screen in pixels
+
+// Coordinate of the vertex in the framebuffer
+in vec2 vertexCoord;
+
+void main() {
+    // Scrolling moves the picture left and up, wrapping around
+    ivec2 index = (ivec2(vertexCoord.x, vertexCoord.y) + cdgScrollOffset) % textureSize(cdgFramebuffer, 0);
+    int colorIndex = int(texelFetch(cdgFramebuffer, index, 0).r);
+
+    vec4 color = texelFetch(cdgPalette, ivec2(colorIndex, 0), 0);
+    vec3 background = texture(cdgBackground, vertexCoord / cdgScreenSize).rgb;
+
+    // Transparent colors let the background through
+    gl_FragColor = vec4(mix(background, color.rgb, color.a), 1.0);
+}
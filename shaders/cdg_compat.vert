@@ -0,0 +1,17 @@
+// !!! This isn't the actual shader used, you need to change shaders.h to reflect changes to this!
+// Fallback for OpenGL 3.0 compatibility contexts
+#version 130
+
+// Corner of a triangle that covers the whole of clip space
+in vec2 position;
+
+// Size of the CDG screen in pixels
+uniform vec2 cdgScreenSize;
+
+out vec2 vertexCoord;
+
+void main() {
+    vertexCoord = vec2(position.x + 1.0, 1.0 - position.y) * 0.5 * cdgScreenSize;
+
+    gl_Position = vec4(position, 0.0, 1.0);
+}
@@ -1,7 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "audio.h"
 
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MINIMP3_IMPLEMENTATION
@@ -9,42 +12,161 @@
 
 #include "util.h"
 
-static struct pcm_buffer *pcm_buffer_from(uint16_t *buf, size_t size) {
-    struct pcm_buffer *pcm;
+static struct pcm_ring *pcm_ring_new(void) {
+    void *ring;
 
-    assert(buf != NULL);
-    assert(size > 0);
+    if (posix_memalign(&ring, CACHE_LINE_SIZE, sizeof(struct pcm_ring)) != 0) {
+        ring = NULL;
+    }
 
-    pcm = (struct pcm_buffer *) malloc(sizeof(struct pcm_buffer));
+    CHECK_MEM(ring)
 
-    CHECK_MEM(pcm)
+    memset(ring, 0, sizeof(struct pcm_ring));
 
-    pcm->index = 0;
-    pcm->size = size;
-    pcm->capacity = size;
-    pcm->buffer = buf;
+    sem_init(&((struct pcm_ring *) ring)->wakeup, 0, 0);
 
-    return pcm;
+    return (struct pcm_ring *) ring;
 }
 
-static void pcm_buffer_consume(struct pcm_buffer *pcm, size_t size, uint16_t *buf) {
-    if ((pcm->index + size) > pcm->size) {
-        fprintf(stderr, "pcm_buffer_consume(): size > pcm->size (asked for %ld, at index %ld, only have %ld)!\n", size, pcm->index, (pcm->size + pcm->index));
-        exit(1);
+static void pcm_ring_free(struct pcm_ring *ring) {
+    if (ring) {
+        sem_destroy(&ring->wakeup);
+
+        free(ring);
+    }
+}
+
+/* +----------------------------------+
+ * | Producer side (decoder thread)   |
+ * +----------------------------------+
+ */
+
+/* Returns the contiguous free space at the write index */
+static size_t pcm_ring_writable(struct pcm_ring *ring, int16_t **buf) {
+    size_t write = ring->write;
+    size_t offset = write & (PCM_RING_SIZE - 1);
+    size_t space = PCM_RING_SIZE - (write - ATOMIC_LOAD_ACQUIRE(ring->read));
+
+    *buf = &ring->buffer[offset];
+
+    return space < PCM_RING_SIZE - offset ? space : PCM_RING_SIZE - offset;
+}
+
+/* Make `count` samples written through pcm_ring_writable() visible to the consumer */
+static void pcm_ring_commit(struct pcm_ring *ring, size_t count) {
+    ATOMIC_STORE_RELEASE(ring->write, ring->write + count);
+}
+
+/* Tell the consumer to drop everything written so far; what comes next starts at `position` */
+static void pcm_ring_flush(struct pcm_ring *ring, int position) {
+    unsigned int seq = ring->flush_seq;
+
+    ATOMIC_STORE_RELAXED(ring->flush_seq, seq + 1);
+    ATOMIC_FENCE_RELEASE();
+
+    ATOMIC_STORE_RELAXED(ring->flush_index, ring->write);
+    ATOMIC_STORE_RELAXED(ring->flush_position, position);
+    ATOMIC_STORE_RELAXED(ring->eof, 0);
+
+    ATOMIC_STORE_RELEASE(ring->flush_seq, seq + 2);
+}
+
+/* +----------------------------------+
+ * | Consumer side (PortAudio thread) |
+ * +----------------------------------+
+ */
+
+/*
+ * Apply the latest flush, if there is one we haven't seen.
+ * Returns 1 if a flush was applied, 0 if there was none, or -1 if one is still being published.
+ */
+static int pcm_ring_take_flush(struct pcm_ring *ring, int *position) {
+    unsigned int seq = ATOMIC_LOAD_ACQUIRE(ring->flush_seq);
+    size_t index;
+    int flushPosition;
+
+    if (seq == ring->seen_flush_seq) {
+        return 0;
+    }
+
+    if (seq & 1) {
+        return -1;
     }
 
-    memcpy(buf, pcm->buffer + pcm->index, size * sizeof(uint16_t));
-    pcm->index += size;
+    index = ATOMIC_LOAD_RELAXED(ring->flush_index);
+    flushPosition = ATOMIC_LOAD_RELAXED(ring->flush_position);
+
+    ATOMIC_FENCE_ACQUIRE();
+
+    if (ATOMIC_LOAD_RELAXED(ring->flush_seq) != seq) {
+        return -1;
+    }
+
+    ring->seen_flush_seq = seq;
+    ATOMIC_STORE_RELEASE(ring->read, index);
+    *position = flushPosition;
+
+    return 1;
 }
 
-static void pcm_buffer_free(struct pcm_buffer *pcm) {
-    if (pcm) {
-        if (pcm->buffer) {
-            free(pcm->buffer);
+/* Copy up to `size` samples out of the ring, given a write index loaded by the caller */
+static size_t pcm_ring_consume(struct pcm_ring *ring, size_t write, size_t size, int16_t *buf) {
+    size_t read = ring->read;
+    size_t offset = read & (PCM_RING_SIZE - 1);
+    size_t count = size < write - read ? size : write - read;
+    size_t first = count < PCM_RING_SIZE - offset ? count : PCM_RING_SIZE - offset;
+
+    memcpy(buf, &ring->buffer[offset], first * sizeof(int16_t));
+    memcpy(buf + first, &ring->buffer[0], (count - first) * sizeof(int16_t));
+
+    ATOMIC_STORE_RELEASE(ring->read, read + count);
+
+    return count;
+}
+
+// Wakes up the decoder thread if it is waiting for room in the ring
+static void audio_state_wake_decoder(struct audio_state *state) {
+    sem_post(&state->ring->wakeup);
+}
+
+// This will be run from the decoder thread.
+static void *audio_decoder_thread_callback(void *userData) {
+    struct audio_state *state = (struct audio_state *) userData;
+    struct pcm_ring *ring = state->ring;
+
+    while (ATOMIC_INT_GET(state->decoding)) {
+        int seekTo;
+        int16_t *buf;
+        size_t space;
+        size_t count;
+
+        // seek_to is only cleared once the flush is published, so the callback never mistakes
+        // the end of the old data for the end of the file. A newer seek is left for the next pass.
+        if ((seekTo = ATOMIC_INT_GET(state->seek_to)) != -1) {
+            pcm_ring_flush(ring, seekTo);
+            mp3dec_ex_seek(&state->mp3d, seekTo);
+            ATOMIC_INT_CAS(state->seek_to, seekTo, -1);
+        }
+
+        space = pcm_ring_writable(ring, &buf);
+
+        // Sleep until the callback makes room, or a seek or stop comes in
+        if (ATOMIC_LOAD_RELAXED(ring->eof) || space < PCM_DECODE_CHUNK / 2) {
+            sem_wait(&ring->wakeup);
+            continue;
         }
 
-        free(pcm);
+        // Decode straight into the ring
+        count = mp3dec_ex_read(&state->mp3d, buf, space < PCM_DECODE_CHUNK ? space : PCM_DECODE_CHUNK);
+
+        if (count == 0) {
+            ATOMIC_STORE_RELEASE(ring->eof, 1);
+        } else {
+            pcm_ring_commit(ring, count);
+        }
     }
+
+    return NULL;
 }
 
 static int paCallback(const void *inputBuffer, void *outputBuffer, unsigned long frameCount,
@@ -65,7 +187,7 @@ static int create_pa_stream(struct audio_state *state) {
 
     restore_stdout_stderr();
 
-    if ((err = Pa_OpenDefaultStream(&stream, 0, state->mp3_file_info.channels, paInt16, state->mp3_file_info.hz, paFramesPerBufferUnspecified, paCallback, state)) != paNoError) {
+    if ((err = Pa_OpenDefaultStream(&stream, 0, state->mp3d.info.channels, paInt16, state->mp3d.info.hz, paFramesPerBufferUnspecified, paCallback, state)) != paNoError) {
         fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
         return 0;
     }
@@ -80,28 +202,106 @@ static int create_pa_stream(struct audio_state *state) {
     return 1;
 }
 
+static int64_t monotonic_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Interpolate the clock from an anchor at the given time */
+static int64_t audio_clock_at(int64_t now, int64_t dacTime, int64_t frame, int64_t minimum, int64_t limit, int hz) {
+    int64_t clock = frame + (now - dacTime) * hz / 1000000000;
+
+    if (clock > limit) {
+        clock = limit;
+    }
+
+    return clock < minimum ? minimum : clock;
+}
+
+/*
+ * Publish a new clock anchor: `frame` reaches the DAC at `dacTime`, and nothing past `limit` has
+ * been played. Only ever called from the PortAudio callback.
+ */
+static void audio_clock_publish(struct audio_state *state, int64_t dacTime, int64_t frame, int64_t minimum, int64_t limit) {
+    unsigned int seq = state->clock_seq;
+
+    ATOMIC_STORE_RELAXED(state->clock_seq, seq + 1);
+    ATOMIC_FENCE_RELEASE();
+
+    ATOMIC_STORE_RELAXED(state->clock_dac_ns, dacTime);
+    ATOMIC_STORE_RELAXED(state->clock_frame, frame);
+    ATOMIC_STORE_RELAXED(state->clock_floor, minimum);
+    ATOMIC_STORE_RELAXED(state->clock_limit, limit);
+
+    ATOMIC_STORE_RELEASE(state->clock_seq, seq + 2);
+}
+
 static int paCallback(const void *inputBuffer, void *outputBuffer, unsigned long frameCount,
                       const PaStreamCallbackTimeInfo *timeInfo, PaStreamCallbackFlags statusFlags,
                         void *userData) {
     UNUSED(inputBuffer); UNUSED(statusFlags);
 
     struct audio_state *state = (struct audio_state *) userData;
-    int latency = (int) ((timeInfo->outputBufferDacTime - timeInfo->currentTime) * 1000.0); // in ms
-    int seekTo; // in frames
-    int audioTs; // in ms
+    struct pcm_ring *ring = state->ring;
+    size_t samples = frameCount * state->mp3d.info.channels;
+    size_t count = 0;
+    size_t write;
+    int position = ATOMIC_INT_GET(state->position);
+    int channels = state->mp3d.info.channels;
+    int64_t now = monotonic_ns();
+    int64_t dacTime = now;
+    int64_t minimum;
+    int flushed;
+    int eof = 0;
+
+    // Load the write index first: if it covers data written after a flush, the flush is visible too
+    write = ATOMIC_LOAD_ACQUIRE(ring->write);
+
+    if ((flushed = pcm_ring_take_flush(ring, &position)) == 1) {
+        write = ATOMIC_LOAD_ACQUIRE(ring->write);
+    }
+
+    // Play silence while a seek is being published, rather than data from either side of it
+    if (flushed != -1) {
+        count = pcm_ring_consume(ring, write, samples, (int16_t *) outputBuffer);
+        position += (int) count;
 
-    if ((seekTo = ATOMIC_INT_GET(state->seek_to)) != -1) {
-        state->pcm->index = seekTo;
+        if (count < samples) {
+            eof = ATOMIC_LOAD_ACQUIRE(ring->eof) && ring->read == ATOMIC_LOAD_ACQUIRE(ring->write)
+                  && ATOMIC_INT_GET(state->seek_to) == -1;
 
-        ATOMIC_INT_SET(state->seek_to, -1);
+            if (!eof) {
+                ATOMIC_STORE_RELAXED(ring->underruns, ring->underruns + 1);
+                ATOMIC_STORE_RELAXED(ring->underrun_samples, ring->underrun_samples + (samples - count));
+            }
+        }
+    }
+
+    memset((int16_t *) outputBuffer + count, 0, (samples - count) * sizeof(int16_t));
+
+    // Some host APIs don't report timing, in which case assume the buffer plays right away
+    if (timeInfo->outputBufferDacTime > 0.0) {
+        dacTime += (int64_t) ((timeInfo->outputBufferDacTime - timeInfo->currentTime) * 1e9);
+    }
+
+    // Carry on from wherever the last buffer had got to, unless a seek made that meaningless
+    if (flushed == 1 || state->clock_frame < 0) {
+        minimum = 0;
+    } else {
+        minimum = audio_clock_at(now, state->clock_dac_ns, state->clock_frame, state->clock_floor, state->clock_limit, state->mp3d.info.hz);
     }
 
-    audioTs = audio_state_get_pos(state) - latency;
+    audio_clock_publish(state, dacTime, (position - (int) count) / channels, minimum, position / channels);
 
-    ATOMIC_INT_SET(state->timestamp, audioTs < 0 ? 0 : audioTs);
-    pcm_buffer_consume(state->pcm, frameCount * state->mp3_file_info.channels, (uint16_t *) outputBuffer);
+    ATOMIC_INT_SET(state->position, position);
 
-    return paContinue;
+    // sem_post() doesn't block, so it's safe to wake the decoder from here
+    sem_post(&ring->wakeup);
+
+    return eof ? paComplete : paContinue;
 }
 
 /* +------------+
@@ -117,70 +317,121 @@ struct audio_state *audio_state_new(void) {
 
     memset(state, 0, sizeof(struct audio_state));
 
-    state->timestamp = -1;
     state->seek_to = -1;
+    state->clock_frame = -1;
 
     return state;
 }
 
+// Close the MP3 file, if one is open
+static void audio_state_close_file(struct audio_state *state) {
+    if (state->ring) {
+        mp3dec_ex_close(&state->mp3d);
+        pcm_ring_free(state->ring);
+        state->ring = NULL;
+    }
+
+    unmap_file(state->mp3_data, state->mp3_size);
+    state->mp3_data = NULL;
+    state->mp3_size = 0;
+}
+
 void audio_state_free(struct audio_state *state) {
     if (state) {
-        if (state->pcm) {
-            pcm_buffer_free(state->pcm);
-        }
+        audio_state_close_file(state);
 
         free(state);
     }
 }
 
-int audio_state_load_file(struct audio_state *state, const char *path, MP3D_PROGRESS_CB progress_cb) {
-    uint8_t *buffer;
-    size_t size;
+int audio_state_load_file(struct audio_state *state, const char *path) {
     int err;
 
-    if (!read_file(path, (char **) &buffer, &size)) {
+    audio_state_close_file(state);
+
+    // The file is only ever mapped once - the decoder reads straight out of the mapping
+    if (!map_file(path, &state->mp3_data, &state->mp3_size)) {
         fprintf(stderr, "failed to read file\n");
         return 0;
     }
 
-    mp3dec_init(&state->mp3d);
-
-    if ((err = mp3dec_load(&state->mp3d, path, &(state->mp3_file_info), progress_cb, state)) < 0) {
+    if ((err = mp3dec_ex_open_buf(&state->mp3d, state->mp3_data, state->mp3_size, MP3D_SEEK_TO_SAMPLE)) < 0) {
         fprintf(stderr, "failed to load MP3 file: %d\n", err);
+        audio_state_close_file(state);
         return 0;
     }
 
-    if (state->pcm) {
-        pcm_buffer_free(state->pcm);
-    }
-
-    state->pcm = pcm_buffer_from((uint16_t *) state->mp3_file_info.buffer, state->mp3_file_info.samples);
+    state->ring = pcm_ring_new();
+    ATOMIC_INT_SET(state->position, 0);
+    ATOMIC_STORE_RELAXED(state->clock_frame, -1);
 
     return 1;
 }
 
 int audio_state_get_pos(struct audio_state *state) {
-    const float samplesPerMs = (float) state->mp3_file_info.hz / 1000.0F;
+    int frames = ATOMIC_INT_GET(state->position) / state->mp3d.info.channels;
 
-    return (int) ((float) state->pcm->index / samplesPerMs / (float) state->mp3_file_info.channels);
+    return (int) AUDIO_FRAMES_TO_MS(frames, state->mp3d.info.hz);
 }
 
-void audio_state_seek(struct audio_state *state, uint32_t ms) {
-    const float samplesPerMs = (float) state->mp3_file_info.hz / 1000.0F;
+int64_t audio_state_get_clock(struct audio_state *state) {
+    unsigned int seq;
+    int64_t dacTime, frame, minimum, limit;
+
+    do {
+        // The callback only holds the sequence odd for a handful of stores
+        while ((seq = ATOMIC_LOAD_ACQUIRE(state->clock_seq)) & 1) {
+        }
 
-    size_t samples = (size_t) ((float) ms * samplesPerMs * (float) state->mp3_file_info.channels);
+        dacTime = ATOMIC_LOAD_RELAXED(state->clock_dac_ns);
+        frame = ATOMIC_LOAD_RELAXED(state->clock_frame);
+        minimum = ATOMIC_LOAD_RELAXED(state->clock_floor);
+        limit = ATOMIC_LOAD_RELAXED(state->clock_limit);
 
-    if (samples > state->mp3_file_info.samples) {
-        samples = state->mp3_file_info.samples;
-        printf("audio_state_seek(): samples > mp3_file_info.samples, setting to mp3_file_info.samples.\n");
+        ATOMIC_FENCE_ACQUIRE();
+    } while (ATOMIC_LOAD_RELAXED(state->clock_seq) != seq);
+
+    if (frame < 0) {
+        return -1;
     }
 
-    ATOMIC_INT_SET(state->seek_to, samples);
+    return audio_clock_at(monotonic_ns(), dacTime, frame, minimum, limit, state->mp3d.info.hz);
+}
+
+int audio_state_get_sample_rate(struct audio_state *state) {
+    return state->mp3d.info.hz;
+}
+
+void audio_state_seek(struct audio_state *state, uint32_t ms) {
+    uint64_t frames = AUDIO_MS_TO_FRAMES(ms, state->mp3d.info.hz);
+    uint64_t length = state->mp3d.samples / state->mp3d.info.channels;
+
+    if (frames > length) {
+        frames = length;
+        printf("audio_state_seek(): seeking past the end, clamping to the last frame.\n");
+    }
+
+    // Always a whole number of frames, so the channels can't end up swapped
+    ATOMIC_INT_SET(state->seek_to, (int) (frames * state->mp3d.info.channels));
+
+    if (state->ring) {
+        audio_state_wake_decoder(state);
+    }
 }
 
 int audio_do_playback(struct audio_state *state) {
+    ATOMIC_INT_SET(state->decoding, 1);
+
+    if (pthread_create(&state->decoder_thread, NULL, audio_decoder_thread_callback, state) != 0) {
+        fprintf(stderr, "failed to start MP3 decoder thread\n");
+        return 0;
+    }
+
     if (!create_pa_stream(state)) {
         fprintf(stderr, "failed to create PortAudio stream\n");
+        ATOMIC_INT_SET(state->decoding, 0);
+        audio_state_wake_decoder(state);
+        pthread_join(state->decoder_thread, NULL);
         return 0;
     }
 
@@ -188,8 +439,15 @@ int audio_do_playback(struct audio_state *state) {
         Pa_Sleep(100);
     }
 
-    pcm_buffer_free(state->pcm);
     Pa_CloseStream(state->stream);
 
+    ATOMIC_INT_SET(state->decoding, 0);
+    audio_state_wake_decoder(state);
+    pthread_join(state->decoder_thread, NULL);
+
+    if (state->ring->underruns > 0) {
+        fprintf(stderr, "audio: %zu underruns (%zu samples of silence)\n", state->ring->underruns, state->ring->underrun_samples);
+    }
+
     return 1;
 }
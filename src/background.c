@@ -0,0 +1,130 @@
+#include "background.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Skip whitespace and comments, then read a decimal number. Returns -1 if there isn't one. */
+static long background_read_number(const uint8_t *data, size_t size, size_t *pos) {
+    long value = 0;
+    size_t start;
+
+    while (*pos < size) {
+        if (data[*pos] == '#') {
+            while (*pos < size && data[*pos] != '\n') {
+                (*pos)++;
+            }
+        } else if (data[*pos] == ' ' || data[*pos] == '\t' || data[*pos] == '\r' || data[*pos] == '\n') {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+
+    start = *pos;
+
+    while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9' && value < 1000000) {
+        value = value * 10 + (data[(*pos)++] - '0');
+    }
+
+    return *pos > start ? value : -1;
+}
+
+/*
+ * Parse the PPM header at `*pos`, and move `*pos` past the frame's pixels. Returns the start of the
+ * pixels, or NULL if the header is bad or the pixels run off the end of the file.
+ */
+static const uint8_t *background_parse_frame(const uint8_t *data, size_t size, size_t *pos, long *width, long *height) {
+    const uint8_t *pixels;
+    long maxValue;
+
+    if (size - *pos < 2 || data[*pos] != 'P' || data[*pos + 1] != '6') {
+        return NULL;
+    }
+
+    *pos += 2;
+
+    *width = background_read_number(data, size, pos);
+    *height = background_read_number(data, size, pos);
+    maxValue = background_read_number(data, size, pos);
+
+    // Only one whitespace character separates the header from the pixels
+    if (*width <= 0 || *height <= 0 || maxValue != 255 || *pos >= size) {
+        return NULL;
+    }
+
+    pixels = data + ++(*pos);
+
+    if ((size_t) (*width * *height * 3) > size - *pos) {
+        return NULL;
+    }
+
+    *pos += (size_t) (*width * *height * 3);
+
+    return pixels;
+}
+
+struct background *background_load(const char *path) {
+    struct background *background = (struct background *) malloc(sizeof(struct background));
+    size_t capacity = 0;
+    size_t pos = 0;
+
+    CHECK_MEM(background)
+
+    memset(background, 0, sizeof(struct background));
+
+    if (!map_file(path, &background->data, &background->size)) {
+        fprintf(stderr, "%s: failed to open file\n", path);
+        free(background);
+        return NULL;
+    }
+
+    // Find every frame up front - only the headers are read, so this doesn't touch the pixels
+    while (pos < background->size) {
+        const uint8_t *pixels;
+        long width, height;
+
+        if ((pixels = background_parse_frame(background->data, background->size, &pos, &width, &height)) == NULL) {
+            fprintf(stderr, "%s: frame %zu is not a complete 8-bit binary PPM\n", path, background->frame_count);
+            break;
+        }
+
+        if (background->frame_count == 0) {
+            background->width = (int) width;
+            background->height = (int) height;
+        } else if (width != background->width || height != background->height) {
+            fprintf(stderr, "%s: frame %zu is a different size to the first\n", path, background->frame_count);
+            break;
+        }
+
+        if (background->frame_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            background->frames = (const uint8_t **) realloc(background->frames, sizeof(const uint8_t *) * capacity);
+
+            CHECK_MEM(background->frames)
+        }
+
+        background->frames[background->frame_count++] = pixels;
+    }
+
+    // Play whatever frames were good
+    if (background->frame_count == 0) {
+        background_free(background);
+        return NULL;
+    }
+
+    return background;
+}
+
+void background_free(struct background *background) {
+    if (background) {
+        unmap_file(background->data, background->size);
+        free(background->frames);
+        free(background);
+    }
+}
+
+const uint8_t *background_get_frame(const struct background *background, size_t index) {
+    return background->frames[index % background->frame_count];
+}
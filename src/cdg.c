@@ -1,10 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <arpa/inet.h> /* ntohs() */
 
 #include "cdg.h"
+#include "profile.h"
 #include "util.h"
 
 static inline int cdg_color_to_rgb(uint16_t color) {
@@ -21,45 +26,358 @@ static inline int cdg_color_to_rgb(uint16_t color) {
     return (r << 16) | (g << 8) | b;
 }
 
+/*
+ * Select masks for one row of a tile, indexed by the 6 pixel bits of that row.
+ * The uppermost valid bit (0x20) is the left-most pixel, so entry N holds 0xFF for every
+ * pixel that takes color_1 and 0x00 for every pixel that takes color_0. Rows are padded
+ * to 8 bytes so that each one can be loaded as a single 64-bit word.
+ */
+#define TILE_MASK_BIT(N, B) (((N) & (B)) ? 0xFF : 0x00)
+#define TILE_MASK_ROW(N) { \
+    TILE_MASK_BIT(N, 0x20), TILE_MASK_BIT(N, 0x10), TILE_MASK_BIT(N, 0x08), \
+    TILE_MASK_BIT(N, 0x04), TILE_MASK_BIT(N, 0x02), TILE_MASK_BIT(N, 0x01), 0, 0 \
+}
+#define TILE_MASK_ROW4(N) TILE_MASK_ROW(N), TILE_MASK_ROW((N) + 1), TILE_MASK_ROW((N) + 2), TILE_MASK_ROW((N) + 3)
+#define TILE_MASK_ROW16(N) TILE_MASK_ROW4(N), TILE_MASK_ROW4((N) + 4), TILE_MASK_ROW4((N) + 8), TILE_MASK_ROW4((N) + 12)
+
+static const uint8_t cdg_tile_row_masks[64][8] = {
+    TILE_MASK_ROW16(0), TILE_MASK_ROW16(16), TILE_MASK_ROW16(32), TILE_MASK_ROW16(48)
+};
+
+#undef TILE_MASK_ROW16
+#undef TILE_MASK_ROW4
+#undef TILE_MASK_ROW
+#undef TILE_MASK_BIT
+
+// Every byte of the result is set to the given value
+#define BROADCAST_BYTE(X) ((uint64_t) (X) * 0x0101010101010101ULL)
+
+// The row and column fields have room for positions that are off the screen
+static inline int cdg_tile_block_on_screen(const struct cdg_insn_tile_block *tile) {
+    return (tile->row & 0x1F) < CDG_TILE_ROWS && (tile->column & 0x3F) < CDG_TILE_COLUMNS;
+}
+
+/*
+ * A pixel's color is color_0 ^ ((color_0 ^ color_1) & mask), which lets a whole row be
+ * computed in one 64-bit word without branching on each pixel bit. Only the first 6 bytes
+ * of the word are stored back into the framebuffer.
+ */
+static void cdg_state_copy_tile(struct cdg_state *state, const struct cdg_insn_tile_block *tile, size_t startRow, size_t startCol) {
+    const uint64_t color0 = BROADCAST_BYTE(tile->color_0 & 0xF);
+    const uint64_t delta = BROADCAST_BYTE((tile->color_0 ^ tile->color_1) & 0xF);
+    uint8_t *row = &state->framebuffer[ARRAY_INDEX(startCol, startRow)];
+
+    state->dirty_tiles[startRow / CDG_TILE_HEIGHT] |= 1ULL << (startCol / CDG_TILE_WIDTH);
+
+    for (int i = 0; i < 12; i++, row += CDG_SCREEN_WIDTH) {
+        uint64_t mask;
+        uint64_t pixels;
+
+        memcpy(&mask, cdg_tile_row_masks[tile->pixels[i] & 0x3F], sizeof(mask));
+        pixels = color0 ^ (delta & mask);
+        memcpy(row, &pixels, CDG_TILE_WIDTH);
+    }
+}
+
+/*
+ * There's no 6-byte load, and assembling a row in a 64-bit word from a 6-byte copy costs a store
+ * forwarding stall on every row, so each row is XORed as a 4-byte word and a 2-byte word instead.
+ */
+static void cdg_state_xor_tile(struct cdg_state *state, const struct cdg_insn_tile_block *tile, size_t startRow, size_t startCol) {
+    const uint32_t color0 = (uint32_t) BROADCAST_BYTE(tile->color_0 & 0xF);
+    const uint32_t delta = (uint32_t) BROADCAST_BYTE((tile->color_0 ^ tile->color_1) & 0xF);
+    uint8_t *row = &state->framebuffer[ARRAY_INDEX(startCol, startRow)];
+
+    state->dirty_tiles[startRow / CDG_TILE_HEIGHT] |= 1ULL << (startCol / CDG_TILE_WIDTH);
+
+    for (int i = 0; i < 12; i++, row += CDG_SCREEN_WIDTH) {
+        const uint8_t *mask = cdg_tile_row_masks[tile->pixels[i] & 0x3F];
+        uint32_t leftMask, left;
+        uint16_t rightMask, right;
+
+        memcpy(&leftMask, mask, sizeof(leftMask));
+        memcpy(&rightMask, mask + 4, sizeof(rightMask));
+        memcpy(&left, row, sizeof(left));
+        memcpy(&right, row + 4, sizeof(right));
+
+        left ^= color0 ^ (delta & leftMask);
+        right ^= (uint16_t) (color0 ^ (delta & rightMask));
+
+        memcpy(row, &left, sizeof(left));
+        memcpy(row + 4, &right, sizeof(right));
+    }
+}
+
+/* Shift every row of the framebuffer a tile to the right or left */
+static void cdg_state_scroll_h(struct cdg_state *state, int command, int fill) {
+    uint8_t vacated[CDG_TILE_WIDTH];
+
+    if (command != CDG_SCROLL_FORWARD && command != CDG_SCROLL_BACKWARD) {
+        return;
+    }
+
+    for (int y = 0; y < CDG_SCREEN_HEIGHT; y++) {
+        uint8_t *row = &state->framebuffer[ARRAY_INDEX(0, y)];
+
+        if (command == CDG_SCROLL_FORWARD) {
+            memcpy(vacated, row + CDG_SCREEN_WIDTH - CDG_TILE_WIDTH, CDG_TILE_WIDTH);
+            memmove(row + CDG_TILE_WIDTH, row, CDG_SCREEN_WIDTH - CDG_TILE_WIDTH);
+        } else {
+            memcpy(vacated, row, CDG_TILE_WIDTH);
+            memmove(row, row + CDG_TILE_WIDTH, CDG_SCREEN_WIDTH - CDG_TILE_WIDTH);
+        }
+
+        if (fill >= 0) {
+            memset(vacated, fill, CDG_TILE_WIDTH);
+        }
+
+        memcpy(command == CDG_SCROLL_FORWARD ? row : row + CDG_SCREEN_WIDTH - CDG_TILE_WIDTH, vacated, CDG_TILE_WIDTH);
+    }
+
+    state->dirty_all = 1;
+}
+
+/* Shift the whole framebuffer a tile down or up */
+static void cdg_state_scroll_v(struct cdg_state *state, int command, int fill) {
+    uint8_t vacated[CDG_SCREEN_WIDTH * CDG_TILE_HEIGHT];
+    uint8_t *top = state->framebuffer;
+    uint8_t *bottom = state->framebuffer + CDG_FRAMEBUFFER_SIZE - sizeof(vacated);
+
+    if (command != CDG_SCROLL_FORWARD && command != CDG_SCROLL_BACKWARD) {
+        return;
+    }
+
+    if (command == CDG_SCROLL_FORWARD) {
+        memcpy(vacated, bottom, sizeof(vacated));
+        memmove(top + sizeof(vacated), top, CDG_FRAMEBUFFER_SIZE - sizeof(vacated));
+    } else {
+        memcpy(vacated, top, sizeof(vacated));
+        memmove(top, top + sizeof(vacated), CDG_FRAMEBUFFER_SIZE - sizeof(vacated));
+    }
+
+    if (fill >= 0) {
+        memset(vacated, fill, sizeof(vacated));
+    }
+
+    memcpy(command == CDG_SCROLL_FORWARD ? top : bottom, vacated, sizeof(vacated));
+
+    state->dirty_all = 1;
+}
+
+/*
+ * Keyframe framebuffers are run-length encoded, one token byte per run:
+ *   low nibble  - color table index
+ *   high nibble - run length (1-15), or 0 if a 16-bit little-endian run length follows
+ * CDG screens are mostly large areas of flat color, so this is usually a few KB. If the encoded
+ * form would be at least as big as the nibble-packed framebuffer, the packed framebuffer is
+ * stored instead; the two are told apart by size.
+ */
+static size_t cdg_rle_encode(const uint8_t *framebuffer, uint8_t *out) {
+    size_t size = 0;
+    size_t i = 0;
+
+    while (i < CDG_FRAMEBUFFER_SIZE) {
+        uint8_t color = framebuffer[i];
+        size_t run = 1;
+
+        while (i + run < CDG_FRAMEBUFFER_SIZE && framebuffer[i + run] == color && run < 0xFFFF) {
+            run++;
+        }
+
+        if (run < 16) {
+            out[size++] = (uint8_t) ((run << 4) | color);
+        } else {
+            out[size++] = color;
+            out[size++] = run & 0xFF;
+            out[size++] = (run >> 8) & 0xFF;
+        }
+
+        i += run;
+    }
+
+    return size;
+}
+
+static int cdg_rle_decode(const uint8_t *in, size_t size, uint8_t *framebuffer) {
+    size_t i = 0;
+    size_t index = 0;
+
+    while (i < size) {
+        uint8_t color = in[i] & 0xF;
+        size_t run = in[i++] >> 4;
+
+        if (run == 0) {
+            if (i + 2 > size) {
+                return 0;
+            }
+
+            run = in[i] | (in[i + 1] << 8);
+            i += 2;
+        }
+
+        if (index + run > CDG_FRAMEBUFFER_SIZE) {
+            return 0;
+        }
+
+        memset(framebuffer + index, color, run);
+        index += run;
+    }
+
+    return index == CDG_FRAMEBUFFER_SIZE;
+}
+
+/* As cdg_rle_decode(), but only checks that the data decodes to exactly one framebuffer */
+static int cdg_rle_check(const uint8_t *in, size_t size) {
+    size_t i = 0;
+    size_t index = 0;
+
+    while (i < size && index <= CDG_FRAMEBUFFER_SIZE) {
+        size_t run = in[i++] >> 4;
+
+        if (run == 0) {
+            if (i + 2 > size) {
+                return 0;
+            }
+
+            run = in[i] | (in[i + 1] << 8);
+            i += 2;
+        }
+
+        index += run;
+    }
+
+    return i == size && index == CDG_FRAMEBUFFER_SIZE;
+}
+
+static void cdg_keyframe_list_add(struct cdg_keyframe_list *list, const struct cdg_state *state, uint8_t *scratch) {
+    struct cdg_keyframe *keyframe;
+    struct cdg_keyframe *previous = list->count > 0 ? &list->keyframes[list->count - 1] : NULL;
+    size_t size;
+
+    size = cdg_rle_encode(state->framebuffer, scratch);
+
+    if (size >= CDG_PACKED_FRAMEBUFFER_SIZE) {
+        cdg_state_pack_framebuffer(state, scratch);
+        size = CDG_PACKED_FRAMEBUFFER_SIZE;
+    }
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->keyframes = (struct cdg_keyframe *) realloc(list->keyframes, sizeof(struct cdg_keyframe) * list->capacity);
+
+        CHECK_MEM(list->keyframes)
+
+        previous = list->count > 0 ? &list->keyframes[list->count - 1] : NULL;
+    }
+
+    keyframe = &list->keyframes[list->count++];
+    memset(keyframe, 0, sizeof(struct cdg_keyframe));
+    keyframe->timestamp = state->ts;
+    memcpy(keyframe->color_table, state->color_table, sizeof(keyframe->color_table));
+    keyframe->h_offset = (uint8_t) state->h_offset;
+    keyframe->v_offset = (uint8_t) state->v_offset;
+    memcpy(keyframe->transparency, state->transparency, sizeof(keyframe->transparency));
+
+    // Nothing was drawn since the last keyframe, so share its framebuffer
+    if (previous && previous->data_size == size && memcmp(list->data + previous->data_offset, scratch, size) == 0) {
+        keyframe->data_offset = previous->data_offset;
+        keyframe->data_size = previous->data_size;
+        return;
+    }
+
+    while (list->data_size + size > list->data_capacity) {
+        list->data_capacity = list->data_capacity ? list->data_capacity * 2 : 64 * 1024;
+        list->data = (uint8_t *) realloc(list->data, list->data_capacity);
+
+        CHECK_MEM(list->data)
+    }
+
+    memcpy(list->data + list->data_size, scratch, size);
+    keyframe->data_offset = (uint32_t) list->data_size;
+    keyframe->data_size = (uint32_t) size;
+    list->data_size += size;
+}
+
+static void cdg_keyframe_list_clear(struct cdg_keyframe_list *list) {
+    if (list->mapping) {
+        unmap_file(list->mapping, list->mapping_size);
+    } else {
+        free(list->keyframes);
+        free(list->data);
+    }
+
+    memset(list, 0, sizeof(struct cdg_keyframe_list));
+}
+
 // Closest, without going over - like The Price is Right :-)
 static struct cdg_keyframe *cdg_reader_find_closest_keyframe(struct cdg_keyframe_list *list, cdg_ts_t ts) {
-    // Binary search
+    // Binary search for the first keyframe after ts
     size_t low = 0;
-    size_t high = list->count - 1;
-    cdg_ts_t bestTs = -1;
-    size_t bestIndex = (size_t) -1;
+    size_t high = list->count;
 
-    while (low <= high) {
+    while (low < high) {
         size_t mid = (low + high) / 2;
-        struct cdg_keyframe *keyframe = &list->keyframes[mid];
-
-        if (keyframe->timestamp == ts) {
-            return keyframe;
-        } else if (keyframe->timestamp < ts) {
-            if (bestIndex == (size_t) -1 || keyframe->timestamp > bestTs) {
-                bestTs = keyframe->timestamp;
-                bestIndex = mid;
-            }
 
+        if (list->keyframes[mid].timestamp <= ts) {
             low = mid + 1;
         } else {
-            high = mid - 1;
+            high = mid;
         }
     }
 
-    assert(bestIndex >= 0 && bestIndex < list->count);
+    // The first keyframe is always at timestamp 0
+    assert(low > 0);
 
-    return &list->keyframes[bestIndex];
+    return &list->keyframes[low - 1];
 }
 
-static void cdg_reader_seek_to_keyframe(struct cdg_reader *reader, struct cdg_keyframe *keyframe) {
-    reader->state.ts = keyframe->timestamp;
-    reader->buffer_index = reader->state.ts * sizeof(struct subchannel_packet);
+// Give the kernel a hint about how the packets in [from, to) are going to be read
+static void cdg_reader_advise(struct cdg_reader *reader, cdg_ts_t from, cdg_ts_t to, int advice) {
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = from * sizeof(struct subchannel_packet);
+    size_t end = to * sizeof(struct subchannel_packet);
+
+    if (!reader->buffer || start >= reader->buffer_size) {
+        return;
+    }
+
+    if (end > reader->buffer_size) {
+        end = reader->buffer_size;
+    }
+
+    // posix_madvise() wants a page-aligned address
+    start -= start % pageSize;
+
+    posix_madvise((void *) (reader->buffer + start), end - start, advice);
+}
+
+void cdg_reader_restore_keyframe(const struct cdg_reader *reader, const struct cdg_keyframe *keyframe, struct cdg_state *state) {
+    const uint8_t *data = reader->keyframes.data + keyframe->data_offset;
+
+    state->ts = keyframe->timestamp;
 
     // Load the color table
-    memcpy(reader->state.color_table, keyframe->color_table, sizeof(reader->state.color_table));
-    // Clear the screen
-    memset(reader->state.framebuffer, keyframe->clear_color, (300 * 216) * sizeof(unsigned int));
+    memcpy(state->color_table, keyframe->color_table, sizeof(state->color_table));
+    memcpy(state->transparency, keyframe->transparency, sizeof(state->transparency));
+    state->palette_dirty = 1;
+
+    // Restore the screen
+    state->dirty_all = 1;
+    state->h_offset = keyframe->h_offset;
+    state->v_offset = keyframe->v_offset;
+
+    if (keyframe->data_size == CDG_PACKED_FRAMEBUFFER_SIZE) {
+        cdg_state_unpack_framebuffer(state, data);
+    } else if (!cdg_rle_decode(data, keyframe->data_size, state->framebuffer)) {
+        assert(0 && "corrupt keyframe");
+    }
+}
+
+static void cdg_reader_seek_to_keyframe(struct cdg_reader *reader, struct cdg_keyframe *keyframe) {
+    cdg_reader_restore_keyframe(reader, keyframe, &reader->state);
+
+    reader->buffer_index = reader->state.ts * sizeof(struct subchannel_packet);
+    reader->eof = 0;
 }
 
 struct cdg_reader *cdg_reader_new(void) {
@@ -69,19 +387,16 @@ struct cdg_reader *cdg_reader_new(void) {
 
     memset(reader, 0, sizeof(struct cdg_reader));
 
+    reader->snapshot_interval = CDG_DEFAULT_SNAPSHOT_INTERVAL;
+
     return reader;
 }
 
 void cdg_reader_free(struct cdg_reader *reader) {
-    struct cdg_keyframe_list *list = &reader->keyframes;
-
-    if (list->keyframes) {
-        free(list->keyframes);
-    }
+    unmap_file(reader->buffer, reader->buffer_size);
+    cdg_keyframe_list_clear(&reader->keyframes);
 
-    if (reader->buffer) {
-        free(reader->buffer);
-    }
+    free(reader);
 }
 
 void cdg_reader_reset(struct cdg_reader *reader) {
@@ -90,23 +405,34 @@ void cdg_reader_reset(struct cdg_reader *reader) {
     reader->eof = 0;
 }
 
-int cdg_reader_read_frame(struct cdg_reader *reader, struct subchannel_packet *outPkt) {
+const struct subchannel_packet *cdg_reader_next_packet(struct cdg_reader *reader) {
+    const struct subchannel_packet *pkt;
     size_t count = sizeof(struct subchannel_packet);
 
     if (reader->buffer_index + count > reader->buffer_size) {
-        return 0;
+        return NULL;
     }
 
-    memcpy(outPkt, reader->buffer + reader->buffer_index, count);
+    // Packets are byte-aligned, so they can be used straight out of the mapping
+    pkt = (const struct subchannel_packet *) (reader->buffer + reader->buffer_index);
     reader->buffer_index += count;
 
-    return 1;
+    return pkt;
 }
 
-// Returns: 1 if we need to update the framebuffer
-int cdg_state_process_insn(struct cdg_state *state, struct subchannel_packet *pkt) {
+const struct subchannel_packet *cdg_reader_packet_at(const struct cdg_reader *reader, cdg_ts_t ts) {
+    size_t count = sizeof(struct subchannel_packet);
+
+    if (ts >= reader->buffer_size / count) {
+        return NULL;
+    }
+
+    return (const struct subchannel_packet *) (reader->buffer + ts * count);
+}
+
+static int cdg_state_execute_insn(struct cdg_state *state, const struct subchannel_packet *pkt) {
     uint8_t code;
-    struct cdg_insn *insn;
+    const struct cdg_insn *insn;
 
     state->ts++;
 
@@ -116,61 +442,63 @@ int cdg_state_process_insn(struct cdg_state *state, struct subchannel_packet *pk
     }
 
     code = pkt->instruction;
-    insn = (struct cdg_insn *) pkt->data;
+    insn = (const struct cdg_insn *) pkt->data;
 
     switch (code) {
         // Load colors 0-7
         case CDG_INSN_LOAD_COLOR_TABLE_00:
         case CDG_INSN_LOAD_COLOR_TABLE_08: {
-            struct cdg_insn_load_color_table *insn_load_color_table = (struct cdg_insn_load_color_table *) insn;
+            const struct cdg_insn_load_color_table *insn_load_color_table = (const struct cdg_insn_load_color_table *) insn;
             size_t offset = code == CDG_INSN_LOAD_COLOR_TABLE_00 ? 0 : 8;
 
             for (int i = 0; i < 8; i++) {
                 state->color_table[i + offset] = cdg_color_to_rgb(ntohs(insn_load_color_table->spec[i] & 0x3F3F));
             }
 
+            state->palette_dirty = 1;
+
             return 1;
         }
         // Clear the screen
         case CDG_INSN_MEMORY_PRESET: {
-            struct cdg_insn_memory_preset *insn_memory_preset = (struct cdg_insn_memory_preset *) insn;
+            const struct cdg_insn_memory_preset *insn_memory_preset = (const struct cdg_insn_memory_preset *) insn;
 
             // The repeat code is incremented each time the same command is sent.
             // This is to ensure the screen is cleared in a potentially unreliable stream.
             // Since we're reading from a file, we can just check if the repeat code is 0 and only do this once.
             if (insn_memory_preset->repeat == 0) {
-                memset(state->framebuffer, insn_memory_preset->color, (300 * 216) * sizeof(unsigned int));
+                memset(state->framebuffer, insn_memory_preset->color & 0xF, sizeof(state->framebuffer));
+                state->dirty_all = 1;
             }
 
             return 1;
         }
         case CDG_INSN_BORDER_PRESET: {
-            // printf("BORDER\n");
             // The border area is the area contained with a
             // rectangle defined by (0,0,300,216) minus the interior pixels which are contained
             // within a rectangle defined by (6,12,294,204).
-            struct cdg_insn_border_preset *insn_border_preset = (struct cdg_insn_border_preset *) insn;
+            const struct cdg_insn_border_preset *insn_border_preset = (const struct cdg_insn_border_preset *) insn;
+            uint8_t color = insn_border_preset->color & 0xF;
 
-            for (int x = 0; x < 300; x++) {
-                if (x > 6 && x < 294) {
-                    continue;
-                }
+            for (int y = 0; y < CDG_SCREEN_HEIGHT; y++) {
+                uint8_t *row = &state->framebuffer[ARRAY_INDEX(0, y)];
 
-                for (int y = 0; y < 216; y++) {
-                    if (y > 12 && y < 204) {
-                        continue;
-                    }
-
-                    state->framebuffer[ARRAY_INDEX(x, y)] = insn_border_preset->color;
+                if (y < 12 || y >= 204) {
+                    memset(row, color, CDG_SCREEN_WIDTH);
+                } else {
+                    memset(row, color, 6);
+                    memset(row + 294, color, CDG_SCREEN_WIDTH - 294);
                 }
             }
+
+            // The border touches every row of tiles, so it is simplest to redraw the whole screen
+            state->dirty_all = 1;
             return 1;
         }
         // Copy a block of pixels into the framebuffer
         case CDG_INSN_TILE_BLOCK:
         case CDG_INSN_TILE_BLOCK_XOR: {
-            struct cdg_insn_tile_block *insn_tile_block = (struct cdg_insn_tile_block *) insn;
-            int isXor = code == CDG_INSN_TILE_BLOCK_XOR;
+            const struct cdg_insn_tile_block *insn_tile_block = (const struct cdg_insn_tile_block *) insn;
 
             size_t startRow;
             size_t startCol;
@@ -179,160 +507,484 @@ int cdg_state_process_insn(struct cdg_state *state, struct subchannel_packet *pk
             startRow = (insn_tile_block->row & 0x1F) * 12;
             startCol = (insn_tile_block->column & 0x3F) * 6;
 
-            // tilePixels[] contains the actual bit values for the tile, six pixels per byte.
-            // The uppermost valid bit of each byte (0x20) contains the left-most pixel of each
-            // scanline of the tile.
-            // pretty sure it's 6 rows of 12 pixels, so 2 bytes per row
+            if (!cdg_tile_block_on_screen(insn_tile_block)) {
+                return 0;
+            }
 
-            for (int i = 0; i < 12; i++) {
-                uint8_t tilePixels = insn_tile_block->pixels[i] & 0x3F;
+            if (code == CDG_INSN_TILE_BLOCK_XOR) {
+                cdg_state_xor_tile(state, insn_tile_block, startRow, startCol);
+            } else {
+                cdg_state_copy_tile(state, insn_tile_block, startRow, startCol);
+            }
 
-                for (int j = 0; j < 6; j++) {
-                    uint8_t pixel = (tilePixels >> (5 - j)) & 1;
-                    uint8_t color = (pixel ? insn_tile_block->color_1 : insn_tile_block->color_0) & 0xF;
+            return 1;
+        }
+        // Make colors see-through, to show a background behind the screen
+        case CDG_INSN_DEF_TRANSPARENT: {
+            const struct cdg_insn_define_transparent *insn_define_transparent = (const struct cdg_insn_define_transparent *) insn;
 
-                    if (isXor) {
-                        state->framebuffer[ARRAY_INDEX(startCol + j, startRow + i)] ^= color;
-                    } else {
-                        state->framebuffer[ARRAY_INDEX(startCol + j, startRow + i)] = color;
-                    }
-                }
+            for (int i = 0; i < 16; i++) {
+                state->transparency[i] = insn_define_transparent->transparency[i] & 0x3F;
             }
 
+            state->palette_dirty = 1;
+
             return 1;
         }
+        // Move the screen a whole tile at a time, and set the fine offsets for smooth scrolling in between
         case CDG_INSN_SCROLL_PRESET:
         case CDG_INSN_SCROLL_COPY: {
-            // TODO: implement - I haven't seen this in any CDG files yet
-            printf("*** Unsupported scrolling instruction!\n");
-//            struct cdg_insn_scroll *insn_scroll = (struct cdg_insn_scroll *) insn;
-//            uint8_t color = insn_scroll->color;
-//            uint8_t h_scroll = insn_scroll->h_scroll;
-//            uint8_t v_scroll = insn_scroll->v_scroll;
+            const struct cdg_insn_scroll *insn_scroll = (const struct cdg_insn_scroll *) insn;
+            int hOffset = CDG_SCROLL_H_OFFSET(insn_scroll->h_scroll);
+            int vOffset = CDG_SCROLL_V_OFFSET(insn_scroll->v_scroll);
+            // SCROLL_PRESET fills in behind the moved screen, SCROLL_COPY wraps it around
+            int fill = code == CDG_INSN_SCROLL_PRESET ? insn_scroll->color & 0xF : -1;
+
+            cdg_state_scroll_h(state, CDG_SCROLL_COMMAND(insn_scroll->h_scroll), fill);
+            cdg_state_scroll_v(state, CDG_SCROLL_COMMAND(insn_scroll->v_scroll), fill);
+
+            state->h_offset = hOffset < CDG_TILE_WIDTH ? hOffset : CDG_TILE_WIDTH - 1;
+            state->v_offset = vOffset < CDG_TILE_HEIGHT ? vOffset : CDG_TILE_HEIGHT - 1;
+
+            return 1;
         }
-        break;
         default:
-            printf("unexpected insn: %d\n", code);
+            // See cdg_packet_check()
+            break;
     }
 
     return 0;
 }
 
-int cdg_reader_load_file(struct cdg_reader *reader, const char *path) {
-    FILE *fp;
+enum cdg_packet_status cdg_packet_check(const struct subchannel_packet *pkt) {
+    if ((pkt->command & 0x3F /* 0b111111 */) != 9) {
+        return CDG_PACKET_NOT_CDG;
+    }
 
-    fp = fopen(path, "r");
+    switch (pkt->instruction) {
+        case CDG_INSN_LOAD_COLOR_TABLE_00:
+        case CDG_INSN_LOAD_COLOR_TABLE_08:
+        case CDG_INSN_MEMORY_PRESET:
+        case CDG_INSN_BORDER_PRESET:
+        case CDG_INSN_DEF_TRANSPARENT:
+            return CDG_PACKET_OK;
+        case CDG_INSN_TILE_BLOCK:
+        case CDG_INSN_TILE_BLOCK_XOR:
+            return cdg_tile_block_on_screen((const struct cdg_insn_tile_block *) pkt->data) ? CDG_PACKET_OK : CDG_PACKET_MALFORMED;
+        case CDG_INSN_SCROLL_PRESET:
+        case CDG_INSN_SCROLL_COPY: {
+            const struct cdg_insn_scroll *insn_scroll = (const struct cdg_insn_scroll *) pkt->data;
+
+            return CDG_SCROLL_H_OFFSET(insn_scroll->h_scroll) < CDG_TILE_WIDTH && CDG_SCROLL_V_OFFSET(insn_scroll->v_scroll) < CDG_TILE_HEIGHT
+                   ? CDG_PACKET_OK : CDG_PACKET_MALFORMED;
+        }
+        default:
+            return CDG_PACKET_UNKNOWN;
+    }
+}
+
+uint32_t cdg_diagnostics_problem_count(const struct cdg_diagnostics *diagnostics) {
+    uint32_t count = 0;
+
+    for (int i = 0; i < 256; i++) {
+        count += diagnostics->unknown[i] + diagnostics->malformed[i];
+    }
+
+    return count;
+}
+
+void cdg_diagnostics_log(const struct cdg_diagnostics *diagnostics, const char *name, FILE *fp) {
+    for (int i = 0; i < 256; i++) {
+        if (diagnostics->unknown[i]) {
+            fprintf(fp, "%s: %u packets with unknown instruction %d\n", name, diagnostics->unknown[i], i);
+        }
+
+        if (diagnostics->malformed[i]) {
+            fprintf(fp, "%s: %u malformed packets with instruction %d\n", name, diagnostics->malformed[i], i);
+        }
+    }
+}
+
+// Returns: 1 if we need to update the framebuffer
+int cdg_state_process_insn(struct cdg_state *state, const struct subchannel_packet *pkt) {
+#ifdef CDG_PROFILE
+    uint64_t start = profile_ticks();
+    int needsUpdate = cdg_state_execute_insn(state, pkt);
+
+    profile_record_insn((pkt->command & 0x3F) == 9 ? pkt->instruction : PROFILE_INSN_NOT_CDG, profile_ticks() - start);
+
+    return needsUpdate;
+#else
+    return cdg_state_execute_insn(state, pkt);
+#endif
+}
+
+/*
+ * Process a packet on behalf of the reader, into either its own state or a scratch one. Each packet
+ * is checked the first time it's reached, so problems are counted once however often it's replayed.
+ */
+static int cdg_reader_process_insn(struct cdg_reader *reader, struct cdg_state *state, const struct subchannel_packet *pkt) {
+    struct cdg_diagnostics *diagnostics = &reader->diagnostics;
+
+    // Until it's processed, the state's timestamp is the packet's
+    if (state->ts >= diagnostics->checked) {
+        switch (cdg_packet_check(pkt)) {
+            case CDG_PACKET_UNKNOWN:
+                diagnostics->unknown[pkt->instruction]++;
+                break;
+            case CDG_PACKET_MALFORMED:
+                diagnostics->malformed[pkt->instruction]++;
+                break;
+            default:
+                break;
+        }
+
+        diagnostics->checked = state->ts + 1;
+    }
+
+    return cdg_state_process_insn(state, pkt);
+}
+
+uint8_t cdg_state_get_pixel(const struct cdg_state *state, int x, int y) {
+    assert(x >= 0 && x < CDG_SCREEN_WIDTH);
+    assert(y >= 0 && y < CDG_SCREEN_HEIGHT);
+
+    return state->framebuffer[ARRAY_INDEX(x, y)];
+}
+
+const uint8_t *cdg_state_get_framebuffer(const struct cdg_state *state) {
+    return state->framebuffer;
+}
 
-    if (!fp) {
+void cdg_state_pack_framebuffer(const struct cdg_state *state, uint8_t *out) {
+    for (size_t i = 0; i < CDG_PACKED_FRAMEBUFFER_SIZE; i++) {
+        out[i] = (uint8_t) ((state->framebuffer[i * 2] << 4) | (state->framebuffer[i * 2 + 1] & 0xF));
+    }
+}
+
+void cdg_state_unpack_framebuffer(struct cdg_state *state, const uint8_t *in) {
+    for (size_t i = 0; i < CDG_PACKED_FRAMEBUFFER_SIZE; i++) {
+        state->framebuffer[i * 2] = in[i] >> 4;
+        state->framebuffer[i * 2 + 1] = in[i] & 0xF;
+    }
+}
+
+void cdg_state_get_screen(const struct cdg_state *state, uint8_t *out) {
+    // Each row is the framebuffer row v_offset further down, rotated left by h_offset
+    for (int y = 0; y < CDG_SCREEN_HEIGHT; y++, out += CDG_SCREEN_WIDTH) {
+        const uint8_t *row = &state->framebuffer[ARRAY_INDEX(0, (y + state->v_offset) % CDG_SCREEN_HEIGHT)];
+
+        memcpy(out, row + state->h_offset, CDG_SCREEN_WIDTH - state->h_offset);
+        memcpy(out + CDG_SCREEN_WIDTH - state->h_offset, row, state->h_offset);
+    }
+}
+
+void cdg_state_to_rgb(const struct cdg_state *state, uint8_t *out) {
+    uint8_t screen[CDG_FRAMEBUFFER_SIZE];
+    const uint8_t *pixels = state->framebuffer;
+
+    if (state->h_offset || state->v_offset) {
+        cdg_state_get_screen(state, screen);
+        pixels = screen;
+    }
+
+    for (size_t i = 0; i < CDG_FRAMEBUFFER_SIZE; i++, out += 3) {
+        int rgb = state->color_table[pixels[i] & 0xF];
+
+        out[0] = (rgb >> 16) & 0xFF;
+        out[1] = (rgb >> 8) & 0xFF;
+        out[2] = rgb & 0xFF;
+    }
+}
+
+void cdg_state_palette_to_rgba(const struct cdg_state *state, uint8_t *out) {
+    for (int i = 0; i < 16; i++, out += 4) {
+        int rgb = state->color_table[i];
+
+        out[0] = (rgb >> 16) & 0xFF;
+        out[1] = (rgb >> 8) & 0xFF;
+        out[2] = rgb & 0xFF;
+        out[3] = (uint8_t) (0xFF - state->transparency[i] * 0xFF / 0x3F);
+    }
+}
+
+int cdg_state_take_palette(struct cdg_state *state, uint8_t *out) {
+    if (!state->palette_dirty) {
         return 0;
     }
 
-    fseek(fp, 0, SEEK_END);
-    reader->buffer_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    cdg_state_palette_to_rgba(state, out);
+    state->palette_dirty = 0;
 
-    reader->buffer_index = 0;
-    reader->buffer = (uint8_t *) malloc(reader->buffer_size);
+    return 1;
+}
+
+int cdg_state_has_dirty_rects(const struct cdg_state *state) {
+    if (state->dirty_all) {
+        return 1;
+    }
+
+    for (int row = 0; row < CDG_TILE_ROWS; row++) {
+        if (state->dirty_tiles[row]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+size_t cdg_state_take_dirty_rects(struct cdg_state *state, struct cdg_rect *rects) {
+    size_t count = 0;
+    size_t previousRow = 0; // Index of the first rectangle that ends on the previous row of tiles
+
+    if (state->dirty_all) {
+        rects[0].x = 0;
+        rects[0].y = 0;
+        rects[0].width = CDG_SCREEN_WIDTH;
+        rects[0].height = CDG_SCREEN_HEIGHT;
+        count = 1;
+    } else {
+        for (int row = 0; row < CDG_TILE_ROWS; row++) {
+            uint64_t bits = state->dirty_tiles[row];
+            size_t currentRow = count;
+            int column = 0;
+
+            // Each run of dirty tiles becomes a rectangle...
+            while (bits >> column) {
+                int start;
+                size_t i;
+
+                while (!((bits >> column) & 1)) {
+                    column++;
+                }
+
+                start = column;
+
+                while ((bits >> column) & 1) {
+                    column++;
+                }
+
+                // ...unless it lines up with a run directly above it, which is extended down instead
+                for (i = previousRow; i < currentRow; i++) {
+                    if (rects[i].x == start * CDG_TILE_WIDTH && rects[i].width == (column - start) * CDG_TILE_WIDTH) {
+                        break;
+                    }
+                }
+
+                if (i < currentRow) {
+                    struct cdg_rect extended = rects[i];
 
-    CHECK_MEM(reader->buffer)
+                    // Move it into this row's rectangles so that the next row can keep extending it
+                    extended.height += CDG_TILE_HEIGHT;
+                    rects[i] = rects[--currentRow];
+                    rects[currentRow] = extended;
+                    continue;
+                }
 
-    if (fread(reader->buffer, 1, reader->buffer_size, fp) != reader->buffer_size) {
-        fclose(fp);
+                rects[count].x = start * CDG_TILE_WIDTH;
+                rects[count].y = row * CDG_TILE_HEIGHT;
+                rects[count].width = (column - start) * CDG_TILE_WIDTH;
+                rects[count].height = CDG_TILE_HEIGHT;
+                count++;
+            }
 
-        free(reader->buffer);
-        reader->buffer = NULL;
-        reader->buffer_size = 0;
+            previousRow = currentRow;
+        }
+    }
 
+    memset(state->dirty_tiles, 0, sizeof(state->dirty_tiles));
+    state->dirty_all = 0;
+
+    return count;
+}
+
+int cdg_reader_load_file(struct cdg_reader *reader, const char *path) {
+    const uint8_t *buffer;
+    size_t size;
+
+    if (!map_file(path, &buffer, &size)) {
         return 0;
     }
 
+    unmap_file(reader->buffer, reader->buffer_size);
+
+    reader->buffer = buffer;
+    reader->buffer_size = size;
+    memset(&reader->diagnostics, 0, sizeof(reader->diagnostics));
+    cdg_reader_reset(reader);
+
+    // Playback reads the file front to back
+    cdg_reader_advise(reader, 0, size / sizeof(struct subchannel_packet), POSIX_MADV_SEQUENTIAL);
+
     return 1;
 }
 
 void cdg_reader_build_keyframe_list(struct cdg_reader *reader) {
-    struct subchannel_packet insn;
-    struct cdg_keyframe *keyframe;
-
-    cdg_ts_t ts = 0;
-    int colorTable[16] = { 0 };
+    const struct subchannel_packet *insn;
+    struct cdg_state *state;
+    uint8_t *scratch;
 
     struct cdg_keyframe_list *list = &reader->keyframes;
 
-    list->keyframes = NULL;
-    list->count = 0;
+    cdg_keyframe_list_clear(list);
+
+    // Decode into a separate state so that the reader's own state is left alone
+    state = (struct cdg_state *) calloc(1, sizeof(struct cdg_state));
+    scratch = (uint8_t *) malloc(CDG_FRAMEBUFFER_SIZE);
+
+    CHECK_MEM(state)
+    CHECK_MEM(scratch)
 
     cdg_reader_reset(reader);
 
-    while (cdg_reader_read_frame(reader, &insn)) {
-        ts++;
+    // Seeking before the first MEMORY_PRESET starts from a blank screen
+    cdg_keyframe_list_add(list, state, scratch);
 
-        // not a CDG packet
-        if ((insn.command & 0x3F /* 0b111111 */) != 9) {
-            continue;
+    while ((insn = cdg_reader_next_packet(reader)) != NULL) {
+        struct cdg_keyframe *last = &list->keyframes[list->count - 1];
+        int isClear;
+
+        cdg_reader_process_insn(reader, state, insn);
+
+        // A MEMORY_PRESET clears the screen, so it makes for a very cheap keyframe
+        isClear = (insn->command & 0x3F /* 0b111111 */) == 9
+                  && insn->instruction == CDG_INSN_MEMORY_PRESET
+                  && ((const struct cdg_insn_memory_preset *) insn->data)->repeat == 0;
+
+        if (isClear || (reader->snapshot_interval && state->ts - last->timestamp >= reader->snapshot_interval)) {
+            cdg_keyframe_list_add(list, state, scratch);
         }
+    }
 
-        if (insn.instruction == CDG_INSN_LOAD_COLOR_TABLE_00) {
-            for (int i = 0; i < 8; i++) {
-                colorTable[i] = cdg_color_to_rgb(ntohs(((struct cdg_insn_load_color_table *) insn.data)->spec[i]));
-            }
-        } else if (insn.instruction == CDG_INSN_LOAD_COLOR_TABLE_08) {
-            for (int i = 0; i < 8; i++) {
-                colorTable[i + 8] = cdg_color_to_rgb(ntohs(((struct cdg_insn_load_color_table *) insn.data)->spec[i]));
-            }
-        } else if (insn.instruction == CDG_INSN_MEMORY_PRESET) {
-            if (((struct cdg_insn_memory_preset *) insn.data)->repeat != 0) {
-                continue;
-            }
+    free(scratch);
+    free(state);
+
+    cdg_reader_reset(reader);
+}
+
+int cdg_keyframe_list_check(const struct cdg_keyframe *keyframes, size_t count,
+                            const uint8_t *data, size_t dataSize, cdg_ts_t packetCount) {
+    if (count == 0 || keyframes[0].timestamp != 0) {
+        return 0;
+    }
 
-            list->keyframes = (struct cdg_keyframe *) realloc(
-                    list->keyframes,
-                    sizeof(struct cdg_keyframe) * (list->count + 1)
-            );
+    for (size_t i = 0; i < count; i++) {
+        const struct cdg_keyframe *keyframe = &keyframes[i];
+        const struct cdg_keyframe *previous = i > 0 ? &keyframes[i - 1] : NULL;
 
-            CHECK_MEM(list->keyframes)
+        if ((previous && keyframe->timestamp <= previous->timestamp) || keyframe->timestamp > packetCount) {
+            return 0;
+        }
+
+        if (keyframe->h_offset >= CDG_TILE_WIDTH || keyframe->v_offset >= CDG_TILE_HEIGHT) {
+            return 0;
+        }
 
-            keyframe = &list->keyframes[list->count];
+        for (int c = 0; c < 16; c++) {
+            if (keyframe->transparency[c] > 0x3F) {
+                return 0;
+            }
+        }
 
-            keyframe->timestamp = ts + 1;
-            memcpy(keyframe->color_table, colorTable, sizeof(colorTable));
-            keyframe->clear_color = ((struct cdg_insn_memory_preset *) insn.data)->color;
+        if ((uint64_t) keyframe->data_offset + keyframe->data_size > dataSize) {
+            return 0;
+        }
 
-            list->count++;
+        // Runs of keyframes share their framebuffer, which only needs checking once
+        if (previous && keyframe->data_offset == previous->data_offset && keyframe->data_size == previous->data_size) {
+            continue;
+        }
+
+        if (keyframe->data_size != CDG_PACKED_FRAMEBUFFER_SIZE && !cdg_rle_check(data + keyframe->data_offset, keyframe->data_size)) {
+            return 0;
         }
     }
 
+    return 1;
+}
+
+void cdg_reader_use_mapped_keyframe_list(struct cdg_reader *reader, const uint8_t *mapping, size_t mappingSize,
+                                         const struct cdg_keyframe *keyframes, size_t count,
+                                         const uint8_t *data, size_t dataSize) {
+    struct cdg_keyframe_list *list = &reader->keyframes;
+
+    assert(count > 0 && keyframes[0].timestamp == 0 && "cdg_keyframe_list_check() must pass first");
+
+    cdg_keyframe_list_clear(list);
+
+    // The list is never added to once built, so it's safe to cast away the mapping's constness
+    list->keyframes = (struct cdg_keyframe *) keyframes;
+    list->count = list->capacity = count;
+    list->data = (uint8_t *) data;
+    list->data_size = list->data_capacity = dataSize;
+    list->mapping = mapping;
+    list->mapping_size = mappingSize;
+
     cdg_reader_reset(reader);
 }
 
-int cdg_reader_seek(struct cdg_reader *reader, cdg_ts_t ts) {
+static int cdg_reader_seek_packets(struct cdg_reader *reader, cdg_ts_t ts) {
     struct cdg_keyframe *keyframe;
-    struct subchannel_packet pkt;
-    int needsUpdate;
+    const struct subchannel_packet *pkt;
+    int needsUpdate = 0;
 
-    if (ts > reader->state.ts) {
-        // Seeking forward: just go straight to the timestamp we want.
-        goto seek_forward;
+    if (ts == reader->state.ts) {
+        return 0;
     }
 
-    // Seeking backward: find the closest keyframe and go there first.
+    assert(reader->keyframes.count > 0 && "cdg_reader_build_keyframe_list() must be called first");
+
+    // Go to the closest keyframe first if we are seeking backward, or if it is ahead of us
     keyframe = cdg_reader_find_closest_keyframe(&reader->keyframes, ts);
-    assert(keyframe != NULL);
-    cdg_reader_seek_to_keyframe(reader, keyframe);
+
+    if (ts < reader->state.ts || keyframe->timestamp > reader->state.ts) {
+        // We are about to jump somewhere that readahead hasn't covered
+        cdg_reader_advise(reader, keyframe->timestamp, ts, POSIX_MADV_WILLNEED);
+        cdg_reader_seek_to_keyframe(reader, keyframe);
+        needsUpdate = 1;
+    }
 
     // ...and then seek forward to the timestamp we want.
-seek_forward:
-    needsUpdate = 0;
     while (reader->state.ts < ts) {
-        if (!cdg_reader_read_frame(reader, &pkt)) {
-            // End of CDG stream
-            printf("cdg_reader_seek(): end of stream\n");
+        if ((pkt = cdg_reader_next_packet(reader)) == NULL) {
+            // End of CDG stream - only counted once, however many times playback runs into it
+            if (!reader->eof) {
+                reader->diagnostics.end_of_stream++;
+            }
+
             reader->eof = 1;
             break;
         }
 
-        // Intentionally using |= here so that cdg_state_process_insn() is always called
-        needsUpdate |= cdg_state_process_insn(&reader->state, &pkt);
+        // Intentionally using |= here so that the packet is always processed
+        needsUpdate |= cdg_reader_process_insn(reader, &reader->state, pkt);
+    }
+
+    return needsUpdate;
+}
+
+int cdg_reader_seek(struct cdg_reader *reader, cdg_ts_t ts) {
+#ifdef CDG_PROFILE
+    cdg_ts_t from = reader->state.ts;
+    uint64_t start, elapsed;
+    const struct cdg_keyframe *keyframe;
+    int needsUpdate, jumped;
+
+    if (ts == from) {
+        return 0;
     }
 
+    start = profile_nanoseconds();
+    needsUpdate = cdg_reader_seek_packets(reader, ts);
+    elapsed = profile_nanoseconds() - start;
+
+    // Work out the route the seek took after the fact, so it isn't timed
+    keyframe = cdg_reader_find_closest_keyframe(&reader->keyframes, ts);
+    jumped = ts < from || keyframe->timestamp > from;
+    profile_record_seek(elapsed, reader->state.ts - (jumped ? keyframe->timestamp : from), jumped);
+
     return needsUpdate;
+#else
+    return cdg_reader_seek_packets(reader, ts);
+#endif
 }
@@ -0,0 +1,388 @@
+#define _XOPEN_SOURCE 700
+
+#include "cdg_index.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME        0x100000001B3ULL
+
+static const uint8_t g_Padding[8] = { 0 };
+
+uint64_t cdg_fnv1a(const uint8_t *data, size_t size) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+void cdg_song_info_compute(const struct cdg_reader *reader, struct cdg_song_info *info) {
+    const struct subchannel_packet *pkt;
+
+    memset(info, 0, sizeof(struct cdg_song_info));
+
+    info->packet_count = reader->buffer_size / sizeof(struct subchannel_packet);
+    info->duration_ms = CDG_TS_TO_MS(info->packet_count);
+    info->checksum = cdg_fnv1a(reader->buffer, reader->buffer_size);
+
+    for (cdg_ts_t ts = 0; (pkt = cdg_reader_packet_at(reader, ts)) != NULL; ts++) {
+        if ((pkt->command & 0x3F /* 0b111111 */) == 9) {
+            info->histogram[pkt->instruction & 0x3F]++;
+        } else {
+            info->other_packets++;
+        }
+    }
+}
+
+int cdg_index_write_header(FILE *fp, uint64_t entryCount, uint64_t tableOffset) {
+    struct cdg_index_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CDG_INDEX_MAGIC, sizeof(header.magic));
+    header.version = CDG_INDEX_VERSION;
+    header.byte_order = CDG_INDEX_BYTE_ORDER;
+    header.entry_count = entryCount;
+    header.table_offset = tableOffset;
+
+    return fwrite(&header, sizeof(header), 1, fp) == 1;
+}
+
+/* Write `size` bytes followed by padding up to the index alignment */
+static int cdg_index_write_padded(FILE *fp, const void *data, uint64_t size) {
+    uint64_t padding = CDG_INDEX_ALIGN(size) - size;
+
+    if (size > 0 && fwrite(data, 1, size, fp) != size) {
+        return 0;
+    }
+
+    return padding == 0 || fwrite(g_Padding, 1, padding, fp) == padding;
+}
+
+static uint64_t cdg_index_entry_expected_size(const struct cdg_index_entry *entry) {
+    // A corrupt data_size could wrap the sum around to something plausible. Nothing real comes close.
+    if (entry->data_size > UINT64_MAX / 2) {
+        return UINT64_MAX;
+    }
+
+    return sizeof(struct cdg_index_entry)
+           + CDG_INDEX_ALIGN((uint64_t) entry->path_length + 1)
+           + (uint64_t) entry->keyframe_count * sizeof(struct cdg_keyframe)
+           + CDG_INDEX_ALIGN(entry->data_size);
+}
+
+int cdg_index_write_entry(FILE *fp, const char *path, uint64_t fileSize, int64_t mtimeNs,
+                          const struct cdg_reader *reader, const struct cdg_song_info *info) {
+    const struct cdg_keyframe_list *list = &reader->keyframes;
+    struct cdg_index_entry entry;
+
+    memset(&entry, 0, sizeof(entry));
+
+    entry.file_size = fileSize;
+    entry.file_mtime_ns = mtimeNs;
+    entry.info = *info;
+    memcpy(&entry.diagnostics, &reader->diagnostics, sizeof(entry.diagnostics));
+    entry.snapshot_interval = reader->snapshot_interval;
+    entry.path_length = (uint32_t) strlen(path);
+    entry.keyframe_count = (uint32_t) list->count;
+    entry.data_size = list->data_size;
+    entry.entry_size = cdg_index_entry_expected_size(&entry);
+
+    return fwrite(&entry, sizeof(entry), 1, fp) == 1
+           && cdg_index_write_padded(fp, path, entry.path_length + 1)
+           && cdg_index_write_padded(fp, list->keyframes, list->count * sizeof(struct cdg_keyframe))
+           && cdg_index_write_padded(fp, list->data, entry.data_size);
+}
+
+static int cdg_index_slot_compare(const void *a, const void *b) {
+    const struct cdg_index_slot *first = (const struct cdg_index_slot *) a;
+    const struct cdg_index_slot *second = (const struct cdg_index_slot *) b;
+
+    if (first->path_hash != second->path_hash) {
+        return first->path_hash < second->path_hash ? -1 : 1;
+    }
+
+    return first->entry_offset < second->entry_offset ? -1 : first->entry_offset > second->entry_offset;
+}
+
+int cdg_index_write_table(FILE *fp, struct cdg_index_slot *slots, uint64_t count) {
+    qsort(slots, count, sizeof(struct cdg_index_slot), cdg_index_slot_compare);
+
+    return count == 0 || fwrite(slots, sizeof(struct cdg_index_slot), count, fp) == count;
+}
+
+int cdg_index_open(struct cdg_index *index, const uint8_t *data, size_t size) {
+    const struct cdg_index_header *header = (const struct cdg_index_header *) data;
+
+    if (size < sizeof(struct cdg_index_header) || memcmp(header->magic, CDG_INDEX_MAGIC, sizeof(header->magic)) != 0) {
+        return 0;
+    }
+
+    if (header->version != CDG_INDEX_VERSION || header->byte_order != CDG_INDEX_BYTE_ORDER) {
+        return 0;
+    }
+
+    // The table has to be the last thing in the file
+    if (header->table_offset < sizeof(struct cdg_index_header) || header->table_offset > size
+        || header->table_offset % 8 != 0
+        || (size - header->table_offset) / sizeof(struct cdg_index_slot) != header->entry_count) {
+        return 0;
+    }
+
+    index->data = data;
+    index->size = size;
+    index->slots = (const struct cdg_index_slot *) (data + header->table_offset);
+    index->entry_count = header->entry_count;
+
+    return 1;
+}
+
+/* Returns the i-th entry if its layout is sound, without checking its keyframes */
+static const struct cdg_index_entry *cdg_index_get_unchecked(const struct cdg_index *index, uint64_t i) {
+    const struct cdg_index_entry *entry;
+    uint64_t offset = index->slots[i].entry_offset;
+    uint64_t limit = (const uint8_t *) index->slots - index->data;
+
+    if (offset < sizeof(struct cdg_index_header) || offset % 8 != 0 || offset + sizeof(struct cdg_index_entry) > limit) {
+        return NULL;
+    }
+
+    entry = (const struct cdg_index_entry *) (index->data + offset);
+
+    // Everything after the entry has to add up, and stay clear of the table
+    if (entry->entry_size != cdg_index_entry_expected_size(entry) || entry->entry_size > limit - offset) {
+        return NULL;
+    }
+
+    if (entry->keyframe_count == 0 || cdg_index_entry_path(entry)[entry->path_length] != '\0') {
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* The keyframes themselves have to be usable too, as a reader takes them as they are */
+static int cdg_index_entry_check_keyframes(const struct cdg_index_entry *entry) {
+    return cdg_keyframe_list_check(cdg_index_entry_keyframes(entry), entry->keyframe_count, cdg_index_entry_data(entry),
+                                   entry->data_size, entry->file_size / sizeof(struct subchannel_packet));
+}
+
+const struct cdg_index_entry *cdg_index_get(const struct cdg_index *index, uint64_t i) {
+    const struct cdg_index_entry *entry = cdg_index_get_unchecked(index, i);
+
+    return entry && cdg_index_entry_check_keyframes(entry) ? entry : NULL;
+}
+
+const struct cdg_index_entry *cdg_index_find(const struct cdg_index *index, const char *path) {
+    uint64_t hash = cdg_fnv1a((const uint8_t *) path, strlen(path));
+
+    // Binary search for the first slot with this hash
+    uint64_t low = 0;
+    uint64_t high = index->entry_count;
+
+    while (low < high) {
+        uint64_t mid = (low + high) / 2;
+
+        if (index->slots[mid].path_hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    // Then check the path, in case of collisions, and only then the keyframes
+    for (; low < index->entry_count && index->slots[low].path_hash == hash; low++) {
+        const struct cdg_index_entry *entry = cdg_index_get_unchecked(index, low);
+
+        if (entry && strcmp(cdg_index_entry_path(entry), path) == 0) {
+            if (!cdg_index_entry_check_keyframes(entry)) {
+                fprintf(stderr, "%s: damaged index entry, ignoring it\n", path);
+                return NULL;
+            }
+
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+const char *cdg_index_entry_path(const struct cdg_index_entry *entry) {
+    return (const char *) (entry + 1);
+}
+
+const struct cdg_keyframe *cdg_index_entry_keyframes(const struct cdg_index_entry *entry) {
+    return (const struct cdg_keyframe *) ((const uint8_t *) (entry + 1) + CDG_INDEX_ALIGN((uint64_t) entry->path_length + 1));
+}
+
+const uint8_t *cdg_index_entry_data(const struct cdg_index_entry *entry) {
+    return (const uint8_t *) (cdg_index_entry_keyframes(entry) + entry->keyframe_count);
+}
+
+static int64_t cdg_stat_mtime_ns(const struct stat *st) {
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Map an index, find the entry for `fullPath` - or its only entry, for a sidecar - and hand it to
+ * the reader if it matches the file as it is now and how the reader would build it.
+ */
+static int cdg_reader_map_index(struct cdg_reader *reader, const char *indexPath, const char *fullPath, int isSidecar) {
+    const struct cdg_index_entry *entry = NULL;
+    struct cdg_index index;
+    const uint8_t *data;
+    size_t size;
+    struct stat st;
+
+    if (stat(fullPath, &st) != 0 || !map_file(indexPath, &data, &size)) {
+        return 0;
+    }
+
+    if (!cdg_index_open(&index, data, size)) {
+        fprintf(stderr, "%s: not a usable CDG index\n", indexPath);
+    } else if (isSidecar) {
+        // Damaged sidecars are rebuilt, and written over, like stale ones
+        if (index.entry_count != 1 || (entry = cdg_index_get(&index, 0)) == NULL) {
+            fprintf(stderr, "%s: damaged sidecar, ignoring it\n", indexPath);
+        }
+    } else {
+        entry = cdg_index_find(&index, fullPath);
+    }
+
+    if (entry == NULL
+        || entry->file_size != (uint64_t) st.st_size
+        || entry->file_mtime_ns != cdg_stat_mtime_ns(&st)
+        || entry->snapshot_interval != reader->snapshot_interval) {
+        unmap_file(data, size);
+        return 0;
+    }
+
+    cdg_reader_use_mapped_keyframe_list(reader, data, size, cdg_index_entry_keyframes(entry), entry->keyframe_count,
+                                        cdg_index_entry_data(entry), entry->data_size);
+
+    // The file isn't decoded now, so its problems are whatever were found when the entry was built
+    memcpy(&reader->diagnostics, &entry->diagnostics, sizeof(reader->diagnostics));
+
+    return 1;
+}
+
+int cdg_reader_load_index(struct cdg_reader *reader, const char *indexPath, const char *path) {
+    char fullPath[PATH_MAX];
+
+    if (realpath(path, fullPath) == NULL) {
+        return 0;
+    }
+
+    return cdg_reader_map_index(reader, indexPath, fullPath, 0);
+}
+
+char *cdg_sidecar_path(const char *path) {
+    const char *base = strrchr(path, '/');
+    const char *extension;
+    size_t length;
+    char *sidecarPath;
+
+    base = base ? base + 1 : path;
+    extension = strrchr(base, '.');
+    length = extension && extension != base ? (size_t) (extension - path) : strlen(path);
+
+    sidecarPath = (char *) malloc(length + sizeof(CDG_SIDECAR_EXTENSION));
+
+    CHECK_MEM(sidecarPath)
+
+    memcpy(sidecarPath, path, length);
+    strcpy(sidecarPath + length, CDG_SIDECAR_EXTENSION);
+
+    return sidecarPath;
+}
+
+int cdg_reader_load_sidecar(struct cdg_reader *reader, const char *path) {
+    char fullPath[PATH_MAX];
+    char *sidecarPath;
+    int ok;
+
+    if (realpath(path, fullPath) == NULL) {
+        return 0;
+    }
+
+    sidecarPath = cdg_sidecar_path(fullPath);
+    ok = cdg_reader_map_index(reader, sidecarPath, fullPath, 1);
+    free(sidecarPath);
+
+    return ok;
+}
+
+int cdg_reader_save_sidecar(const struct cdg_reader *reader, const char *path) {
+    struct cdg_song_info info;
+    struct cdg_index_slot slot;
+    uint64_t tableOffset;
+    struct stat st;
+    char fullPath[PATH_MAX];
+    char *sidecarPath;
+    char *tempPath;
+    FILE *fp;
+    int ok;
+
+    if (realpath(path, fullPath) == NULL || stat(fullPath, &st) != 0) {
+        return 0;
+    }
+
+    sidecarPath = cdg_sidecar_path(fullPath);
+    tempPath = (char *) malloc(strlen(sidecarPath) + 32);
+
+    CHECK_MEM(tempPath)
+
+    // Write it alongside and move it into place, so no reader ever maps half a sidecar
+    sprintf(tempPath, "%s.%ld.tmp", sidecarPath, (long) getpid());
+
+    if ((fp = fopen(tempPath, "wb")) == NULL) {
+        free(tempPath);
+        free(sidecarPath);
+        return 0;
+    }
+
+    cdg_song_info_compute(reader, &info);
+
+    slot.path_hash = cdg_fnv1a((const uint8_t *) fullPath, strlen(fullPath));
+    slot.entry_offset = sizeof(struct cdg_index_header);
+
+    ok = cdg_index_write_header(fp, 1, 0)
+         && cdg_index_write_entry(fp, fullPath, (uint64_t) st.st_size, cdg_stat_mtime_ns(&st), reader, &info);
+
+    // Now we know where the table goes
+    tableOffset = (uint64_t) ftello(fp);
+
+    ok = ok && cdg_index_write_table(fp, &slot, 1)
+         && fseeko(fp, 0, SEEK_SET) == 0
+         && cdg_index_write_header(fp, 1, tableOffset);
+    ok = (fclose(fp) == 0) && ok && rename(tempPath, sidecarPath) == 0;
+
+    if (!ok) {
+        remove(tempPath);
+    }
+
+    free(tempPath);
+    free(sidecarPath);
+
+    return ok;
+}
+
+void cdg_reader_prepare_keyframe_list(struct cdg_reader *reader, const char *path) {
+    if (cdg_reader_load_sidecar(reader, path)) {
+        return;
+    }
+
+    cdg_reader_build_keyframe_list(reader);
+
+    // Libraries on read-only media just go without
+    cdg_reader_save_sidecar(reader, path);
+}
@@ -0,0 +1,376 @@
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdg.h"
+#include "cdg_index.h"
+#include "profile.h"
+#include "util.h"
+
+/*
+ * cdg-index: scan directory trees for CDG files and build an index of them on a pool of worker
+ * threads, so a player can load a song's keyframe list instead of decoding the whole file first.
+ */
+
+/* Most directories nftw() may hold open at once */
+#define INDEX_MAX_OPEN_DIRS 32
+
+/* The files to index */
+struct index_paths {
+    char **paths;
+    size_t count;
+    size_t capacity;
+};
+
+/* One index being built by a pool of worker threads */
+struct index_job {
+    const struct index_paths *paths;
+    ATOMIC_INT next_path;   /* Next path for a worker to pick up */
+    ATOMIC_INT failures;    /* Files that couldn't be read */
+
+    /* Guarded by `lock` - workers append their entries as they finish them */
+    FILE *fp;
+    struct cdg_index_slot *slots; /* One per path, at most */
+    uint64_t entry_count;
+    int write_failed;
+    pthread_mutex_t lock;
+};
+
+/* nftw() has no way to pass its callback any data of our own */
+static struct index_paths g_Paths;
+
+static int index_collect_callback(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    const char *extension = strrchr(path + ftw->base, '.');
+
+    UNUSED(st);
+
+    if (type == FTW_F && extension && strcasecmp(extension, ".cdg") == 0) {
+        if (g_Paths.count == g_Paths.capacity) {
+            g_Paths.capacity = g_Paths.capacity ? g_Paths.capacity * 2 : 1024;
+            g_Paths.paths = (char **) realloc(g_Paths.paths, sizeof(char *) * g_Paths.capacity);
+
+            CHECK_MEM(g_Paths.paths)
+        }
+
+        g_Paths.paths[g_Paths.count] = strdup(path);
+
+        CHECK_MEM(g_Paths.paths[g_Paths.count])
+
+        g_Paths.count++;
+    } else if (type == FTW_DNR) {
+        fprintf(stderr, "%s: failed to read directory\n", path);
+    }
+
+    return 0;
+}
+
+/* Add every CDG file under `root` - or `root` itself, if it's a file - by absolute path */
+static int index_collect(const char *root) {
+    char fullPath[PATH_MAX];
+
+    if (realpath(root, fullPath) == NULL) {
+        fprintf(stderr, "%s: no such file or directory\n", root);
+        return 0;
+    }
+
+    // Don't follow symlinks, so a link back up the tree can't send us round in circles
+    return nftw(fullPath, index_collect_callback, INDEX_MAX_OPEN_DIRS, FTW_PHYS) == 0;
+}
+
+static int index_compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Drop paths that were collected more than once, e.g. a file named along with its directory */
+static void index_remove_duplicates(struct index_paths *paths) {
+    size_t kept = 0;
+
+    if (paths->count == 0) {
+        return;
+    }
+
+    qsort(paths->paths, paths->count, sizeof(char *), index_compare_paths);
+
+    for (size_t i = 1; i < paths->count; i++) {
+        if (strcmp(paths->paths[i], paths->paths[kept]) == 0) {
+            free(paths->paths[i]);
+        } else {
+            paths->paths[++kept] = paths->paths[i];
+        }
+    }
+
+    paths->count = kept + 1;
+}
+
+static int index_file(struct index_job *job, const char *path) {
+    struct cdg_reader *reader = cdg_reader_new();
+    struct cdg_song_info info;
+    struct stat st;
+    int ok = 0;
+
+    if (stat(path, &st) != 0 || !cdg_reader_load_file(reader, path)) {
+        fprintf(stderr, "%s: failed to open file\n", path);
+        cdg_reader_free(reader);
+        return 0;
+    }
+
+    cdg_reader_build_keyframe_list(reader);
+    cdg_song_info_compute(reader, &info);
+    cdg_diagnostics_log(&reader->diagnostics, path, stderr);
+
+    pthread_mutex_lock(&job->lock);
+
+    if (!job->write_failed) {
+        struct cdg_index_slot *slot = &job->slots[job->entry_count];
+
+        slot->path_hash = cdg_fnv1a((const uint8_t *) path, strlen(path));
+        slot->entry_offset = (uint64_t) ftello(job->fp);
+
+        if (cdg_index_write_entry(job->fp, path, (uint64_t) st.st_size,
+                                  (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, reader, &info)) {
+            job->entry_count++;
+            ok = 1;
+        } else {
+            job->write_failed = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&job->lock);
+
+    cdg_reader_free(reader);
+
+    return ok;
+}
+
+static void *index_worker_thread_callback(void *userData) {
+    struct index_job *job = (struct index_job *) userData;
+    int i;
+
+    while ((i = ATOMIC_INT_FETCH_ADD(job->next_path, 1)) < (int) job->paths->count) {
+        if (!index_file(job, job->paths->paths[i])) {
+            ATOMIC_INT_FETCH_ADD(job->failures, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/* Index every collected path into `fp`, returning the number of files that couldn't be indexed */
+static int index_build(FILE *fp, const struct index_paths *paths, int threads) {
+    struct index_job job;
+    pthread_t *workers;
+    int started = 0;
+    uint64_t tableOffset;
+
+    memset(&job, 0, sizeof(job));
+
+    job.paths = paths;
+    job.fp = fp;
+    job.slots = (struct cdg_index_slot *) malloc(sizeof(struct cdg_index_slot) * (paths->count ? paths->count : 1));
+    workers = (pthread_t *) malloc(sizeof(pthread_t) * (threads > 1 ? threads - 1 : 1));
+
+    CHECK_MEM(job.slots)
+    CHECK_MEM(workers)
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    // The real header goes in once we know where the table ends up
+    if (!cdg_index_write_header(fp, 0, 0)) {
+        job.write_failed = 1;
+    }
+
+    // This thread is one of them
+    for (int i = 0; i < threads - 1 && !job.write_failed; i++) {
+        if (pthread_create(&workers[i], NULL, index_worker_thread_callback, &job) != 0) {
+            fprintf(stderr, "failed to create worker thread\n");
+            break;
+        }
+
+        started++;
+    }
+
+    // Index whatever the workers didn't get to on this thread - all of it, if none started
+    index_worker_thread_callback(&job);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    tableOffset = (uint64_t) ftello(fp);
+
+    if (job.write_failed
+        || !cdg_index_write_table(fp, job.slots, job.entry_count)
+        || fseeko(fp, 0, SEEK_SET) != 0
+        || !cdg_index_write_header(fp, job.entry_count, tableOffset)) {
+        job.write_failed = 1;
+    }
+
+    pthread_mutex_destroy(&job.lock);
+
+    free(workers);
+    free(job.slots);
+
+    return job.write_failed ? -1 : job.failures;
+}
+
+static int index_list(const char *indexPath) {
+    const uint8_t *data;
+    size_t size;
+    struct cdg_index index;
+    int ok = 1;
+
+    if (!map_file(indexPath, &data, &size)) {
+        fprintf(stderr, "%s: failed to open file\n", indexPath);
+        return 0;
+    }
+
+    if (!cdg_index_open(&index, data, size)) {
+        fprintf(stderr, "%s: not a usable CDG index\n", indexPath);
+        unmap_file(data, size);
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < index.entry_count; i++) {
+        const struct cdg_index_entry *entry = cdg_index_get(&index, i);
+
+        if (entry == NULL) {
+            fprintf(stderr, "%s: entry %llu is corrupt\n", indexPath, (unsigned long long) i);
+            ok = 0;
+            continue;
+        }
+
+        printf("%s\n", cdg_index_entry_path(entry));
+        printf("    duration %llu:%02llu, %llu packets, %u keyframes (%llu bytes), checksum %016llx\n",
+               (unsigned long long) (entry->info.duration_ms / 60000),
+               (unsigned long long) (entry->info.duration_ms / 1000 % 60),
+               (unsigned long long) entry->info.packet_count, entry->keyframe_count,
+               (unsigned long long) entry->data_size, (unsigned long long) entry->info.checksum);
+        printf("    instructions:");
+
+        for (int insn = 0; insn < CDG_INSN_COUNT; insn++) {
+            if (entry->info.histogram[insn] > 0) {
+                printf(" %d=%u", insn, entry->info.histogram[insn]);
+            }
+        }
+
+        printf(" other=%u\n", entry->info.other_packets);
+        printf("    %u unknown or malformed packets\n", cdg_diagnostics_problem_count(&entry->diagnostics));
+    }
+
+    unmap_file(data, size);
+
+    return ok;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-j threads] -o index <dir|cdg> [<dir|cdg>...]\n", name);
+    fprintf(stderr, "       %s -l index\n", name);
+    fprintf(stderr, "  -j  number of threads to index with (default: one per CPU)\n");
+    fprintf(stderr, "  -o  index file to write, replacing any existing one\n");
+    fprintf(stderr, "  -l  list the contents of an index\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = NULL;
+    const char *listPath = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timespec start, end;
+    char *tempPath;
+    FILE *fp;
+    int failures = 0;
+    int buildFailures;
+    int opt;
+
+    PROFILE_INIT();
+
+    while ((opt = getopt(argc, argv, "o:l:j:h")) != -1) {
+        switch (opt) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'l':
+                listPath = optarg;
+                break;
+            case 'j':
+                if ((threads = strtol(optarg, NULL, 10)) < 1) {
+                    fprintf(stderr, "invalid thread count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (listPath) {
+        return !index_list(listPath);
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    if (output == NULL || optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = optind; i < argc; i++) {
+        if (!index_collect(argv[i])) {
+            failures++;
+        }
+    }
+
+    index_remove_duplicates(&g_Paths);
+
+    // Build the new index alongside the old one, so nothing ever sees it half-written
+    tempPath = (char *) malloc(strlen(output) + sizeof(".tmp"));
+
+    CHECK_MEM(tempPath)
+
+    sprintf(tempPath, "%s.tmp", output);
+
+    if ((fp = fopen(tempPath, "wb")) == NULL) {
+        fprintf(stderr, "%s: failed to open for writing\n", tempPath);
+        return 1;
+    }
+
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+    // The file list is final by now, so the workers can share it without locking
+    buildFailures = index_build(fp, &g_Paths, (int) threads);
+
+    if (fclose(fp) != 0 || buildFailures < 0 || rename(tempPath, output) != 0) {
+        fprintf(stderr, "%s: failed to write index\n", output);
+        remove(tempPath);
+        return 1;
+    }
+
+    failures += buildFailures;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fprintf(stderr, "indexed %zu files in %.2f s, %d failed\n", g_Paths.count - buildFailures,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, failures);
+
+    for (size_t i = 0; i < g_Paths.count; i++) {
+        free(g_Paths.paths[i]);
+    }
+
+    free(g_Paths.paths);
+    free(tempPath);
+
+    return failures > 0;
+}
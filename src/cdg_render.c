@@ -0,0 +1,555 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cdg.h"
+#include "profile.h"
+#include "util.h"
+
+/*
+ * cdg-render: decode CDG files on the CPU and write them out as video frames, without needing a
+ * display, OpenGL or audio. Frames are written back to back, so the output can be piped straight
+ * into an encoder.
+ */
+
+enum render_format {
+    RENDER_FORMAT_RAW, /* Packed 8-bit RGB, no headers */
+    RENDER_FORMAT_Y4M, /* YUV4MPEG2, 4:2:0 */
+    RENDER_FORMAT_PPM  /* One binary PPM after another */
+};
+
+struct render_options {
+    enum render_format format;
+
+    /* Frame rate, as a fraction */
+    uint64_t fps_num;
+    uint64_t fps_den;
+};
+
+/* A run of output frames starting at a keyframe, so it can be rendered on its own */
+struct render_segment {
+    const struct cdg_keyframe *keyframe;
+    uint64_t first_frame;
+    uint64_t frame_count;
+    uint8_t *frames;      /* The distinct frames, once rendered - borrowed from a render_buffer */
+    size_t unique_count;
+    uint32_t *frame_refs; /* Which of them each of the frame_count output frames is */
+    int done;
+};
+
+/*
+ * Memory for rendered frames. At most `window` segments are in flight at once, so segment N can
+ * reuse the buffer of segment N - window - reusing it, rather than allocating fresh memory for
+ * every segment, saves faulting in hundreds of megabytes of new pages per song.
+ */
+struct render_buffer {
+    uint8_t *frames;
+    size_t capacity;      /* In frames */
+    uint32_t *frame_refs;
+    size_t ref_capacity;
+};
+
+/* One file being rendered by a pool of worker threads */
+struct render_job {
+    const struct cdg_reader *reader; /* Shared, read-only */
+    const struct render_options *options;
+
+    struct render_segment *segments;
+    size_t segment_count;
+
+    /* Guarded by `lock`, and signaled through `cond` whenever any of them changes */
+    size_t next_segment; /* Next segment for a worker to pick up */
+    size_t written;      /* Segments written out so far */
+    size_t window;       /* How far workers may get ahead of the writer */
+    struct render_buffer *buffers; /* One per segment in the window */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Size of one output frame in the given format, headers excluded */
+static size_t render_frame_size(enum render_format format) {
+    if (format == RENDER_FORMAT_Y4M) {
+        return CDG_FRAMEBUFFER_SIZE + 2 * (CDG_FRAMEBUFFER_SIZE / 4);
+    }
+
+    return CDG_FRAMEBUFFER_SIZE * 3;
+}
+
+/*
+ * Convert the screen to planar 4:2:0 BT.601 YCbCr. There are only 16 colors, so each is converted
+ * once and the planes are built by lookup, averaging each 2x2 block's chroma.
+ */
+static void render_to_yuv420(const struct cdg_state *state, uint8_t *out) {
+    uint8_t screen[CDG_FRAMEBUFFER_SIZE];
+    const uint8_t *framebuffer = cdg_state_get_framebuffer(state);
+    uint8_t *cb = out + CDG_FRAMEBUFFER_SIZE;
+    uint8_t *cr = cb + CDG_FRAMEBUFFER_SIZE / 4;
+    int y[16], u[16], v[16];
+
+    for (int i = 0; i < 16; i++) {
+        int r = (state->color_table[i] >> 16) & 0xFF;
+        int g = (state->color_table[i] >> 8) & 0xFF;
+        int b = state->color_table[i] & 0xFF;
+
+        y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+
+    // Only a scrolled screen needs rearranging first
+    if (state->h_offset || state->v_offset) {
+        cdg_state_get_screen(state, screen);
+        framebuffer = screen;
+    }
+
+    for (size_t i = 0; i < CDG_FRAMEBUFFER_SIZE; i++) {
+        out[i] = (uint8_t) y[framebuffer[i] & 0xF];
+    }
+
+    for (int row = 0; row < CDG_SCREEN_HEIGHT; row += 2) {
+        const uint8_t *top = framebuffer + ARRAY_INDEX(0, row);
+        const uint8_t *bottom = top + CDG_SCREEN_WIDTH;
+
+        for (int column = 0; column < CDG_SCREEN_WIDTH; column += 2) {
+            int a = top[column] & 0xF, b = top[column + 1] & 0xF;
+            int c = bottom[column] & 0xF, d = bottom[column + 1] & 0xF;
+
+            *cb++ = (uint8_t) ((u[a] + u[b] + u[c] + u[d] + 2) >> 2);
+            *cr++ = (uint8_t) ((v[a] + v[b] + v[c] + v[d] + 2) >> 2);
+        }
+    }
+}
+
+static void render_convert(const struct cdg_state *state, enum render_format format, uint8_t *out) {
+    if (format == RENDER_FORMAT_Y4M) {
+        render_to_yuv420(state, out);
+    } else {
+        cdg_state_to_rgb(state, out);
+    }
+}
+
+static int render_write_header(FILE *fp, const struct render_options *options) {
+    if (options->format == RENDER_FORMAT_Y4M) {
+        return fprintf(fp, "YUV4MPEG2 W%d H%d F%llu:%llu Ip A1:1 C420jpeg\n", CDG_SCREEN_WIDTH, CDG_SCREEN_HEIGHT,
+                       (unsigned long long) options->fps_num, (unsigned long long) options->fps_den) > 0;
+    }
+
+    return 1;
+}
+
+static int render_write_frame(FILE *fp, enum render_format format, const uint8_t *frame) {
+    if (format == RENDER_FORMAT_Y4M && fputs("FRAME\n", fp) == EOF) {
+        return 0;
+    }
+
+    if (format == RENDER_FORMAT_PPM && fprintf(fp, "P6\n%d %d\n255\n", CDG_SCREEN_WIDTH, CDG_SCREEN_HEIGHT) < 0) {
+        return 0;
+    }
+
+    return fwrite(frame, 1, render_frame_size(format), fp) == render_frame_size(format);
+}
+
+/* Returns the timestamp shown by the given frame */
+static cdg_ts_t render_frame_ts(const struct render_options *options, uint64_t frame) {
+    return (cdg_ts_t) (frame * CDG_PACKETS_PER_SECOND * options->fps_den / options->fps_num);
+}
+
+/* Returns the first frame that shows the given timestamp or a later one */
+static uint64_t render_first_frame_at(const struct render_options *options, cdg_ts_t ts) {
+    uint64_t scale = CDG_PACKETS_PER_SECOND * options->fps_den;
+
+    return (ts * options->fps_num + scale - 1) / scale;
+}
+
+/*
+ * Split a song into segments of about `target` frames. Each one starts at a keyframe, so they can
+ * all be rendered independently of each other.
+ */
+static size_t render_split(const struct cdg_reader *reader, const struct render_options *options, uint64_t frames,
+                           uint64_t target, struct render_segment **out) {
+    const struct cdg_keyframe_list *list = &reader->keyframes;
+    struct render_segment *segments;
+    size_t count = 0;
+
+    segments = (struct render_segment *) calloc(list->count, sizeof(struct render_segment));
+
+    CHECK_MEM(segments)
+
+    // The first keyframe is always at timestamp 0
+    segments[0].keyframe = &list->keyframes[0];
+
+    for (size_t i = 1; i < list->count; i++) {
+        uint64_t frame = render_first_frame_at(options, list->keyframes[i].timestamp);
+
+        if (frame >= frames) {
+            break;
+        }
+
+        if (frame - segments[count].first_frame >= target) {
+            segments[count].frame_count = frame - segments[count].first_frame;
+
+            count++;
+            segments[count].keyframe = &list->keyframes[i];
+            segments[count].first_frame = frame;
+        }
+    }
+
+    segments[count].frame_count = frames - segments[count].first_frame;
+
+    *out = segments;
+
+    return count + 1;
+}
+
+static void render_segment(const struct render_job *job, size_t index, struct cdg_state *state) {
+    const struct render_options *options = job->options;
+    struct render_segment *segment = &job->segments[index];
+    struct render_buffer *buffer = &job->buffers[index % job->window];
+    size_t frameSize = render_frame_size(options->format);
+    const struct subchannel_packet *pkt;
+
+    if (buffer->ref_capacity < segment->frame_count) {
+        buffer->ref_capacity = segment->frame_count;
+        buffer->frame_refs = (uint32_t *) realloc(buffer->frame_refs, buffer->ref_capacity * sizeof(uint32_t));
+
+        CHECK_MEM(buffer->frame_refs)
+    }
+
+    segment->unique_count = 0;
+
+    cdg_reader_restore_keyframe(job->reader, segment->keyframe, state);
+
+    for (uint64_t i = 0; i < segment->frame_count; i++) {
+        cdg_ts_t ts = render_frame_ts(options, segment->first_frame + i);
+        int changed = i == 0;
+
+        while (state->ts < ts && (pkt = cdg_reader_packet_at(job->reader, state->ts)) != NULL) {
+            changed |= cdg_state_process_insn(state, pkt);
+        }
+
+        // Most frames look just like the one before, so only convert and keep the ones that changed
+        if (changed) {
+            if (segment->unique_count == buffer->capacity) {
+                buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 16;
+                buffer->frames = (uint8_t *) realloc(buffer->frames, buffer->capacity * frameSize);
+
+                CHECK_MEM(buffer->frames)
+            }
+
+            render_convert(state, options->format, buffer->frames + segment->unique_count * frameSize);
+            segment->unique_count++;
+        }
+
+        buffer->frame_refs[i] = (uint32_t) (segment->unique_count - 1);
+    }
+
+    segment->frames = buffer->frames;
+    segment->frame_refs = buffer->frame_refs;
+}
+
+static void *render_worker_thread_callback(void *userData) {
+    struct render_job *job = (struct render_job *) userData;
+    struct cdg_state *state = (struct cdg_state *) malloc(sizeof(struct cdg_state));
+    size_t index;
+
+    CHECK_MEM(state)
+
+    pthread_mutex_lock(&job->lock);
+
+    for (;;) {
+        // Don't get too far ahead of the writer, or finished frames pile up in memory
+        while (job->next_segment < job->segment_count && job->next_segment >= job->written + job->window) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+
+        if (job->next_segment >= job->segment_count) {
+            break;
+        }
+
+        index = job->next_segment++;
+
+        pthread_mutex_unlock(&job->lock);
+        render_segment(job, index, state);
+        pthread_mutex_lock(&job->lock);
+
+        job->segments[index].done = 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+
+    pthread_mutex_unlock(&job->lock);
+
+    free(state);
+
+    return NULL;
+}
+
+/*
+ * Render one file. Segments are handed out to `threads` workers and written in order as they
+ * finish; with a single thread, they're just rendered one after another here.
+ */
+static int render_file(const char *inPath, FILE *fp, const struct render_options *options, int threads) {
+    struct cdg_reader *reader = cdg_reader_new();
+    struct render_job job;
+    pthread_t *workers = NULL;
+    size_t frameSize = render_frame_size(options->format);
+    uint64_t packets, frames, second;
+    int started = 0;
+    int ok = 0;
+
+    memset(&job, 0, sizeof(job));
+
+    if (!cdg_reader_load_file(reader, inPath)) {
+        fprintf(stderr, "%s: failed to open file\n", inPath);
+        cdg_reader_free(reader);
+        return 0;
+    }
+
+    cdg_reader_build_keyframe_list(reader);
+
+    // Building the keyframes decoded the whole song, so any problems with it are known by now
+    cdg_diagnostics_log(&reader->diagnostics, inPath, stderr);
+
+    // Enough frames to cover every packet
+    packets = reader->buffer_size / sizeof(struct subchannel_packet);
+    frames = render_first_frame_at(options, packets);
+
+    // About a second per segment: plenty to keep the threads busy, and small enough to stay in cache
+    second = (options->fps_num + options->fps_den - 1) / options->fps_den;
+
+    job.reader = reader;
+    job.options = options;
+    job.segment_count = render_split(reader, options, frames, second, &job.segments);
+    job.window = (size_t) threads * 2;
+    job.buffers = (struct render_buffer *) calloc(job.window, sizeof(struct render_buffer));
+
+    CHECK_MEM(job.buffers)
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    if (threads > 1) {
+        workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+
+        CHECK_MEM(workers)
+
+        for (; started < threads; started++) {
+            if (pthread_create(&workers[started], NULL, render_worker_thread_callback, &job) != 0) {
+                break;
+            }
+        }
+    }
+
+    if (!render_write_header(fp, options)) {
+        goto write_error;
+    }
+
+    for (size_t i = 0; i < job.segment_count; i++) {
+        struct render_segment *segment = &job.segments[i];
+
+        if (started == 0) {
+            render_segment(&job, i, &reader->state);
+        } else {
+            pthread_mutex_lock(&job.lock);
+
+            while (!segment->done) {
+                pthread_cond_wait(&job.cond, &job.lock);
+            }
+
+            pthread_mutex_unlock(&job.lock);
+        }
+
+        for (uint64_t frame = 0; frame < segment->frame_count; frame++) {
+            if (!render_write_frame(fp, options->format, segment->frames + segment->frame_refs[frame] * frameSize)) {
+                goto write_error;
+            }
+        }
+
+        pthread_mutex_lock(&job.lock);
+        job.written++;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    if (fflush(fp) == EOF) {
+        goto write_error;
+    }
+
+    ok = 1;
+    goto out;
+
+write_error:
+    fprintf(stderr, "%s: failed to write output\n", inPath);
+
+out:
+    // Stop handing out work, and let the workers finish whatever they're on
+    pthread_mutex_lock(&job.lock);
+    job.next_segment = job.segment_count;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (size_t i = 0; i < job.window; i++) {
+        free(job.buffers[i].frames);
+        free(job.buffers[i].frame_refs);
+    }
+
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+
+    free(workers);
+    free(job.buffers);
+    free(job.segments);
+    cdg_reader_free(reader);
+
+    return ok;
+}
+
+/* Substitute the input's base name, without its extension, for the %s in an output pattern */
+static char *render_output_path(const char *pattern, const char *inPath) {
+    const char *base = strrchr(inPath, '/');
+    const char *extension;
+    const char *marker = strstr(pattern, "%s");
+    size_t baseLength;
+    char *path;
+
+    base = base ? base + 1 : inPath;
+    extension = strrchr(base, '.');
+    baseLength = extension && extension != base ? (size_t) (extension - base) : strlen(base);
+
+    path = (char *) malloc(strlen(pattern) + baseLength + 1);
+
+    CHECK_MEM(path)
+
+    if (marker == NULL) {
+        strcpy(path, pattern);
+        return path;
+    }
+
+    memcpy(path, pattern, marker - pattern);
+    memcpy(path + (marker - pattern), base, baseLength);
+    strcpy(path + (marker - pattern) + baseLength, marker + 2);
+
+    return path;
+}
+
+static int parse_format(const char *name, enum render_format *format) {
+    if (strcmp(name, "raw") == 0) {
+        *format = RENDER_FORMAT_RAW;
+    } else if (strcmp(name, "y4m") == 0) {
+        *format = RENDER_FORMAT_Y4M;
+    } else if (strcmp(name, "ppm") == 0) {
+        *format = RENDER_FORMAT_PPM;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Accepts either a whole number of frames per second, or a fraction such as 30000/1001 */
+static int parse_fps(const char *text, uint64_t *num, uint64_t *den) {
+    char *end;
+
+    *num = strtoull(text, &end, 10);
+    *den = 1;
+
+    if (*end == '/') {
+        *den = strtoull(end + 1, &end, 10);
+    }
+
+    return *end == '\0' && *num > 0 && *den > 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-f y4m|raw|ppm] [-r fps[/den]] [-j threads] [-o output] <cdg> [<cdg>...]\n", name);
+    fprintf(stderr, "  -f  output format (default y4m; raw is packed 8-bit RGB)\n");
+    fprintf(stderr, "  -r  frame rate (default 30)\n");
+    fprintf(stderr, "  -j  number of threads to render with (default: one per CPU)\n");
+    fprintf(stderr, "  -o  output file, or - for stdout (the default). With several inputs this must\n");
+    fprintf(stderr, "      contain %%s, which is replaced by each input's name without its extension.\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct render_options options = { RENDER_FORMAT_Y4M, 30, 1 };
+    const char *output = "-";
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int failures = 0;
+    int opt;
+
+    PROFILE_INIT();
+
+    while ((opt = getopt(argc, argv, "f:r:o:j:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (!parse_format(optarg, &options.format)) {
+                    fprintf(stderr, "unknown format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (!parse_fps(optarg, &options.fps_num, &options.fps_den)) {
+                    fprintf(stderr, "invalid frame rate: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'j':
+                if ((threads = strtol(optarg, NULL, 10)) < 1) {
+                    fprintf(stderr, "invalid thread count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (argc - optind > 1 && strstr(output, "%s") == NULL) {
+        fprintf(stderr, "an output pattern containing %%s is needed for more than one input\n");
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        char *path = render_output_path(output, argv[i]);
+        FILE *fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+
+        if (fp == NULL) {
+            fprintf(stderr, "%s: failed to open for writing\n", path);
+            failures++;
+        } else {
+            // Frames are big and written whole, so buffer generously
+            setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+            if (!render_file(argv[i], fp, &options, (int) threads)) {
+                failures++;
+            }
+
+            if (fp != stdout) {
+                fclose(fp);
+            }
+        }
+
+        free(path);
+    }
+
+    return failures > 0;
+}
@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "decoder.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* The longest the decoder thread sleeps between looking at the audio clock - one CDG packet */
+#define CDG_DECODER_POLL_NS (1000000000L / CDG_PACKETS_PER_SECOND)
+
+/* Move the changes recorded in a state into a dirty map, and mark the state clean */
+static void cdg_dirty_map_take(struct cdg_dirty_map *map, struct cdg_state *state) {
+    memcpy(map->tiles, state->dirty_tiles, sizeof(map->tiles));
+    map->all = state->dirty_all;
+    map->palette = state->palette_dirty;
+
+    memset(state->dirty_tiles, 0, sizeof(state->dirty_tiles));
+    state->dirty_all = 0;
+    state->palette_dirty = 0;
+}
+
+static void cdg_dirty_map_merge(struct cdg_dirty_map *map, const struct cdg_dirty_map *other) {
+    for (int row = 0; row < CDG_TILE_ROWS; row++) {
+        map->tiles[row] |= other->tiles[row];
+    }
+
+    map->all |= other->all;
+    map->palette |= other->palette;
+}
+
+/* Add the changes in a dirty map to those already recorded in a state */
+static void cdg_dirty_map_apply(const struct cdg_dirty_map *map, struct cdg_state *state) {
+    for (int row = 0; row < CDG_TILE_ROWS; row++) {
+        state->dirty_tiles[row] |= map->tiles[row];
+    }
+
+    state->dirty_all |= map->all;
+    state->palette_dirty |= map->palette;
+}
+
+/*
+ * Hand the reader's current state to the render thread. The render thread may skip frames, so
+ * each frame carries every change since the last one it's known to have taken: if the frame we
+ * get back was never taken, its changes are still outstanding and roll over into the next one.
+ */
+static void cdg_decoder_publish(struct cdg_decoder *decoder) {
+    struct cdg_state *frame = decoder->frames[decoder->back];
+    struct cdg_dirty_map changes;
+    int previous;
+
+    cdg_dirty_map_take(&changes, &decoder->reader->state);
+
+    memcpy(frame, &decoder->reader->state, sizeof(struct cdg_state));
+    cdg_dirty_map_apply(&changes, frame);
+    cdg_dirty_map_apply(&decoder->unconsumed, frame);
+
+    previous = ATOMIC_INT_EXCHANGE(decoder->middle, decoder->back | CDG_DECODER_FRAME_FRESH);
+    decoder->back = previous & ~CDG_DECODER_FRAME_FRESH;
+
+    if (previous & CDG_DECODER_FRAME_FRESH) {
+        cdg_dirty_map_merge(&decoder->unconsumed, &changes);
+    } else {
+        decoder->unconsumed = changes;
+    }
+}
+
+/*
+ * Sleep until the packet after `ts` is due by the audio clock, but never for longer than one poll
+ * period, so seeks are noticed quickly.
+ */
+static void cdg_decoder_wait(int64_t clock, cdg_ts_t ts, int hz) {
+    struct timespec delay = { 0, CDG_DECODER_POLL_NS };
+    int64_t nextFrame = (int64_t) CDG_TS_TO_FRAMES(ts + 1, hz);
+
+    if (clock >= 0 && nextFrame > clock && (nextFrame - clock) * 1000000000 / hz < CDG_DECODER_POLL_NS) {
+        delay.tv_nsec = (long) ((nextFrame - clock) * 1000000000 / hz);
+    }
+
+    nanosleep(&delay, NULL);
+}
+
+static void *cdg_decoder_thread_callback(void *userData) {
+    struct cdg_decoder *decoder = (struct cdg_decoder *) userData;
+
+    while (ATOMIC_INT_GET(decoder->running)) {
+        int64_t clock = audio_state_get_clock(decoder->audio);
+        int hz = 0;
+
+        // A negative clock means playback hasn't started yet
+        if (clock >= 0) {
+            hz = audio_state_get_sample_rate(decoder->audio);
+
+            if (cdg_reader_seek(decoder->reader, CDG_FRAMES_TO_TS(clock, hz))) {
+                cdg_decoder_publish(decoder);
+            }
+        }
+
+        cdg_decoder_wait(clock, decoder->reader->state.ts, hz);
+    }
+
+    return NULL;
+}
+
+struct cdg_decoder *cdg_decoder_new(struct cdg_reader *reader, struct audio_state *audio) {
+    struct cdg_decoder *decoder = (struct cdg_decoder *) malloc(sizeof(struct cdg_decoder));
+
+    CHECK_MEM(decoder)
+
+    memset(decoder, 0, sizeof(struct cdg_decoder));
+
+    decoder->reader = reader;
+    decoder->audio = audio;
+
+    // Every frame starts out as the reader's current state, with nothing left to upload
+    for (int i = 0; i < 3; i++) {
+        decoder->frames[i] = (struct cdg_state *) malloc(sizeof(struct cdg_state));
+
+        CHECK_MEM(decoder->frames[i])
+
+        memcpy(decoder->frames[i], &reader->state, sizeof(struct cdg_state));
+        memset(decoder->frames[i]->dirty_tiles, 0, sizeof(decoder->frames[i]->dirty_tiles));
+        decoder->frames[i]->dirty_all = 0;
+        decoder->frames[i]->palette_dirty = 0;
+    }
+
+    decoder->back = 0;
+    decoder->middle = 1;
+    decoder->front = 2;
+
+    return decoder;
+}
+
+void cdg_decoder_free(struct cdg_decoder *decoder) {
+    if (decoder) {
+        cdg_decoder_stop(decoder);
+
+        for (int i = 0; i < 3; i++) {
+            free(decoder->frames[i]);
+        }
+
+        free(decoder);
+    }
+}
+
+int cdg_decoder_start(struct cdg_decoder *decoder) {
+    ATOMIC_INT_SET(decoder->running, 1);
+
+    if (pthread_create(&decoder->thread, NULL, cdg_decoder_thread_callback, decoder) != 0) {
+        fprintf(stderr, "failed to create CDG decoder thread\n");
+        ATOMIC_INT_SET(decoder->running, 0);
+        return 0;
+    }
+
+    return 1;
+}
+
+void cdg_decoder_stop(struct cdg_decoder *decoder) {
+    int running = 1;
+
+    // Only the first caller gets to join
+    if (ATOMIC_INT_CAS(decoder->running, running, 0)) {
+        pthread_join(decoder->thread, NULL);
+    }
+}
+
+int cdg_decoder_has_frame(struct cdg_decoder *decoder) {
+    return (ATOMIC_LOAD_ACQUIRE(decoder->middle) & CDG_DECODER_FRAME_FRESH) != 0;
+}
+
+struct cdg_state *cdg_decoder_take_frame(struct cdg_decoder *decoder) {
+    // Only the decoder thread sets the fresh flag, so it can't be cleared under us
+    if (!cdg_decoder_has_frame(decoder)) {
+        return NULL;
+    }
+
+    decoder->front = ATOMIC_INT_EXCHANGE(decoder->middle, decoder->front) & ~CDG_DECODER_FRAME_FRESH;
+
+    return decoder->frames[decoder->front];
+}
@@ -1,73 +1,96 @@
 #include <stdio.h>
 #include <string.h>
 #include <GL/glew.h>
-#include <GL/glut.h>
+#include <GL/glxew.h>
+#include <GL/freeglut.h>
 #include <assert.h>
+#include <stdint.h>
 
 #include "cdg.h"
+#include "cdg_index.h"
 #include "audio.h"
-#include "shaders.h"
+#include "background.h"
+#include "decoder.h"
+#include "profile.h"
+#include "renderer.h"
 
-struct {
-    GLuint id;
-    GLint colorTableLocation;
-    GLint framebufferLocation;
-} g_Shader;
+/* How often to check whether the CDG screen needs updating - about once per display refresh */
+#define UPDATE_INTERVAL_MS 16
 
-static GLuint g_TextureId = 0;
+static struct renderer *g_Renderer;
+static struct cdg_state *g_Frame;     /* Latest frame taken from the decoder */
+static int g_FramePending = 0;        /* Set until g_Frame has been uploaded */
 static struct cdg_reader *g_Reader;
+static struct cdg_decoder *g_Decoder;
 static struct audio_state *g_AudioState;
+static struct background *g_Background;
+static long g_BackgroundFps = BACKGROUND_DEFAULT_FPS;
+static size_t g_BackgroundFrame = SIZE_MAX; /* Frame of the background last shown */
 
-void display(void) {
-    uint32_t ms;
+// Which frame of the background should be showing - videos follow the audio clock, from the start of playback
+static size_t background_due_frame(void) {
+    int64_t clock;
+
+    if (g_Background->frame_count == 1 || (clock = audio_state_get_clock(g_AudioState)) < 0) {
+        return 0;
+    }
+
+    return (size_t) ((uint64_t) clock * (uint64_t) g_BackgroundFps / (uint64_t) audio_state_get_sample_rate(g_AudioState));
+}
 
+void display(void) {
     glClearColor(0, 0, 0, 1);
     glClear(GL_COLOR_BUFFER_BIT);
 
-    glActiveTexture(GL_TEXTURE0);
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, g_TextureId);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    // Hang on to a frame until it's fully uploaded, so none of its changes get lost
+    if (!g_FramePending && (g_Frame = cdg_decoder_take_frame(g_Decoder)) != NULL) {
+        g_FramePending = 1;
+    }
 
-    glUseProgram(g_Shader.id);
-    ms = ATOMIC_INT_GET(g_AudioState->timestamp);
+    // If the upload got put off, try again next frame
+    if (g_FramePending && (g_FramePending = !renderer_update(g_Renderer, g_Frame))) {
+        glutPostRedisplay();
+    }
 
-    if (cdg_reader_seek(g_Reader, MS_TO_CDG_FRAME_COUNT(ms))) {
-        glUniform1i(g_Shader.framebufferLocation, 0);
-        glUniform1iv(g_Shader.colorTableLocation, 16, g_Reader->state.color_table);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 300, 216, 0, GL_RGBA, GL_UNSIGNED_BYTE, g_Reader->state.framebuffer);
+    if (g_Background) {
+        size_t frame = background_due_frame();
+
+        if (frame != g_BackgroundFrame) {
+            renderer_set_background(g_Renderer, g_Background->width, g_Background->height,
+                                    background_get_frame(g_Background, frame));
+            g_BackgroundFrame = frame;
+        }
     }
 
-    glBegin(GL_QUADS);
-        glTexCoord2f(0, 0); glVertex2f(0, 0);
-        glTexCoord2f(1, 0); glVertex2f(300, 0);
-        glTexCoord2f(1, 1); glVertex2f(300, 216);
-        glTexCoord2f(0, 1); glVertex2f(0, 216);
-    glEnd();
+    renderer_draw(g_Renderer);
 
-    glFlush();
     glutSwapBuffers();
-    glutPostRedisplay();
 }
 
-void resizeCallback(int width, int height) {
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+// Only redraw when the decoder or the background has a new frame - GLUT takes care of expose and resize.
+void updateTimerCallback(int value) {
+    UNUSED(value);
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+    if (cdg_decoder_has_frame(g_Decoder) || (g_Background && background_due_frame() != g_BackgroundFrame)) {
+        glutPostRedisplay();
+    }
 
-    glViewport(0, 0, width, height);
-    glOrtho(0, 300, 216, 0, 0.0, 100.0);
+    glutTimerFunc(UPDATE_INTERVAL_MS, updateTimerCallback, 0);
+}
 
-    if (g_TextureId == 0) {
-        glGenTextures(1, &g_TextureId);
+// Pace buffer swaps to the display refresh rate, where the driver lets us
+static void enable_vsync(void) {
+    if (GLXEW_MESA_swap_control) {
+        glXSwapIntervalMESA(1);
+    } else if (GLXEW_SGI_swap_control) {
+        glXSwapIntervalSGI(1);
     }
 }
 
+void resizeCallback(int width, int height) {
+    renderer_resize(g_Renderer, width, height);
+}
+
 static void seek(uint32_t ms) {
     audio_state_seek(g_AudioState, ms);
 }
@@ -84,7 +107,8 @@ void specialKeyboardCallback(int key, int x, int y) {
             seek(currentPos + 1000);
             break;
         case GLUT_KEY_LEFT:
-            seek(currentPos - 1000);
+            // Don't wrap around to the end of the song
+            seek(currentPos > 1000 ? currentPos - 1000 : 0);
             break;
         default:
             // Do nothing
@@ -96,7 +120,7 @@ void specialKeyboardCallback(int key, int x, int y) {
 static void *mp3_player_thread_callback(void *userData) {
     assert(userData != NULL);
 
-    if (!audio_state_load_file(g_AudioState, (char *) userData, NULL)) {
+    if (!audio_state_load_file(g_AudioState, (char *) userData)) {
         fprintf(stderr, "failed to load MP3 file\n");
         return (void *) 0;
     }
@@ -110,11 +134,26 @@ static void *mp3_player_thread_callback(void *userData) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <cdg> <mp3>\n", argv[0]);
+    PROFILE_INIT();
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "usage: %s <cdg> <mp3> [background]\n", argv[0]);
         return 1;
     }
 
+    // Something to show through transparent colors - a PPM image, or a video of PPMs back to back
+    if (argc == 4) {
+        if ((g_Background = background_load(argv[3])) == NULL) {
+            fprintf(stderr, "failed to load background\n");
+            return 1;
+        }
+
+        if (getenv("CDG_BACKGROUND_FPS") != NULL && (g_BackgroundFps = strtol(getenv("CDG_BACKGROUND_FPS"), NULL, 10)) <= 0) {
+            fprintf(stderr, "invalid background frame rate\n");
+            return 1;
+        }
+    }
+
     // Set up the CDG reader
     g_Reader = cdg_reader_new();
 
@@ -123,47 +162,65 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    cdg_reader_build_keyframe_list(g_Reader);
+    // A library index built by cdg-index, or the song's own sidecar, saves decoding the whole file up front
+    if (getenv("CDG_INDEX") == NULL || !cdg_reader_load_index(g_Reader, getenv("CDG_INDEX"), argv[1])) {
+        cdg_reader_prepare_keyframe_list(g_Reader, argv[1]);
+    }
+
+    // Building keyframes decodes the whole song, so any problems with it are known before playback starts
+    cdg_diagnostics_log(&g_Reader->diagnostics, argv[1], stderr);
 
     // Set up OpenGL
     glutInit(&argc, argv);
 
+    // Ask for a core profile unless told not to - the renderer falls back to GLSL 1.30 either way
+    if (getenv("CDG_GL_COMPAT") == NULL) {
+        glutInitContextVersion(3, 3);
+        glutInitContextProfile(GLUT_CORE_PROFILE);
+    }
+
     glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
-    glutInitWindowSize(300*4, 216*4);
+    glutInitWindowSize(CDG_SCREEN_WIDTH * 4, CDG_SCREEN_HEIGHT * 4);
 
     glutCreateWindow("CDG");
 
     glewExperimental = GL_TRUE;
     glewInit();
 
-    if ((g_Shader.id = load_shader_program(CDG_VERTEX_SHADER_SOURCE, CDG_FRAGMENT_SHADER_SOURCE)) == 0) {
-        fprintf(stderr, "failed to load shader program\n");
-        return 1;
-    }
+    enable_vsync();
 
-    if ((g_Shader.colorTableLocation = glGetUniformLocation(g_Shader.id, "cdgColorMap")) == -1) {
-        fprintf(stderr, "failed to get color table uniform location\n");
-        return 1;
-    }
+    // Core profiles have no default vertex array, so GLEW's extension probing can leave a stale error
+    glGetError();
 
-    if ((g_Shader.framebufferLocation = glGetUniformLocation(g_Shader.id, "cdgFramebuffer")) == -1) {
-        fprintf(stderr, "failed to get framebuffer uniform location\n");
+    if ((g_Renderer = renderer_new(&g_Reader->state)) == NULL) {
+        fprintf(stderr, "failed to set up renderer\n");
         return 1;
     }
 
     glutDisplayFunc(display);
     glutReshapeFunc(resizeCallback);
     glutSpecialFunc(specialKeyboardCallback);
+    glutTimerFunc(UPDATE_INTERVAL_MS, updateTimerCallback, 0);
 
     // Set up the MP3 player
     g_AudioState = audio_state_new();
     pthread_create(&g_AudioState->thread, NULL, mp3_player_thread_callback, argv[2]);
 
+    // The decoder follows the audio from here on, and owns the reader
+    g_Decoder = cdg_decoder_new(g_Reader, g_AudioState);
+
+    if (!cdg_decoder_start(g_Decoder)) {
+        return 1;
+    }
+
     // Start rendering
     glutMainLoop();
 
+    cdg_decoder_free(g_Decoder);
+    renderer_free(g_Renderer);
     cdg_reader_free(g_Reader);
     audio_state_free(g_AudioState);
+    background_free(g_Background);
 
     return 0;
 }
@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "profile.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cdg.h"
+#include "util.h"
+
+/* Written only by the thread that owns them, and read by whoever is dumping */
+struct profile_counters {
+    uint64_t insn_count[PROFILE_INSN_SLOTS];
+    uint64_t insn_ticks[PROFILE_INSN_SLOTS];
+
+    uint64_t seek_count;
+    uint64_t seek_nanoseconds;
+    uint64_t seek_packets;
+    uint64_t seek_jumps;
+    uint64_t seek_histogram[PROFILE_SEEK_BUCKETS];
+
+    struct profile_counters *next;
+};
+
+#define PROFILE_LOAD(X) __atomic_load_n(&(X), __ATOMIC_RELAXED)
+#define PROFILE_ADD(X, V) __atomic_store_n(&(X), PROFILE_LOAD(X) + (V), __ATOMIC_RELAXED)
+
+static __thread struct profile_counters *threadCounters;
+
+static pthread_mutex_t countersLock = PTHREAD_MUTEX_INITIALIZER;
+static struct profile_counters *allCounters;
+
+static pthread_mutex_t dumpLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* For working out how long a tick is */
+static uint64_t startTicks;
+static uint64_t startNanoseconds;
+
+static struct profile_counters *profile_get_counters(void) {
+    struct profile_counters *counters = threadCounters;
+
+    if (counters == NULL) {
+        // Kept after the thread exits, so its totals still make it into the dump
+        counters = (struct profile_counters *) calloc(1, sizeof(struct profile_counters));
+
+        CHECK_MEM(counters)
+
+        pthread_mutex_lock(&countersLock);
+        counters->next = allCounters;
+        allCounters = counters;
+        pthread_mutex_unlock(&countersLock);
+
+        threadCounters = counters;
+    }
+
+    return counters;
+}
+
+uint64_t profile_nanoseconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+uint64_t profile_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return profile_nanoseconds();
+#endif
+}
+
+void profile_record_insn(int slot, uint64_t ticks) {
+    struct profile_counters *counters = profile_get_counters();
+
+    PROFILE_ADD(counters->insn_count[slot], 1);
+    PROFILE_ADD(counters->insn_ticks[slot], ticks);
+}
+
+void profile_record_seek(uint64_t nanoseconds, uint64_t packets, int jumped) {
+    struct profile_counters *counters = profile_get_counters();
+    int bucket = 0;
+
+    while (bucket < PROFILE_SEEK_BUCKETS - 1 && nanoseconds >> (bucket + 1)) {
+        bucket++;
+    }
+
+    PROFILE_ADD(counters->seek_count, 1);
+    PROFILE_ADD(counters->seek_nanoseconds, nanoseconds);
+    PROFILE_ADD(counters->seek_packets, packets);
+    PROFILE_ADD(counters->seek_jumps, jumped ? 1 : 0);
+    PROFILE_ADD(counters->seek_histogram[bucket], 1);
+}
+
+static const char *profile_insn_name(int slot) {
+    switch (slot) {
+        case CDG_INSN_MEMORY_PRESET:       return "MEMORY_PRESET";
+        case CDG_INSN_BORDER_PRESET:       return "BORDER_PRESET";
+        case CDG_INSN_TILE_BLOCK:          return "TILE_BLOCK";
+        case CDG_INSN_SCROLL_PRESET:       return "SCROLL_PRESET";
+        case CDG_INSN_SCROLL_COPY:         return "SCROLL_COPY";
+        case CDG_INSN_DEF_TRANSPARENT:     return "DEF_TRANSPARENT";
+        case CDG_INSN_LOAD_COLOR_TABLE_00: return "LOAD_COLOR_TABLE_00";
+        case CDG_INSN_LOAD_COLOR_TABLE_08: return "LOAD_COLOR_TABLE_08";
+        case CDG_INSN_TILE_BLOCK_XOR:      return "TILE_BLOCK_XOR";
+        case PROFILE_INSN_NOT_CDG:         return "NOT_CDG";
+        default:                           return "UNKNOWN";
+    }
+}
+
+static void profile_write(FILE *fp, const struct profile_counters *totals, double ticksPerSecond) {
+    int first = 1;
+
+    fprintf(fp, "{\n");
+#if defined(__x86_64__) || defined(__i386__)
+    fprintf(fp, "  \"clock\": \"rdtsc\",\n");
+#else
+    fprintf(fp, "  \"clock\": \"clock_gettime\",\n");
+#endif
+    fprintf(fp, "  \"ticks_per_second\": %.0f,\n", ticksPerSecond);
+    fprintf(fp, "  \"instructions\": [");
+
+    for (int i = 0; i < PROFILE_INSN_SLOTS; i++) {
+        if (totals->insn_count[i] == 0) {
+            continue;
+        }
+
+        fprintf(fp, "%s\n    {\"code\": %d, \"name\": \"%s\", \"count\": %llu, \"ticks\": %llu, \"mean_ns\": %.1f}",
+                first ? "" : ",", i == PROFILE_INSN_NOT_CDG ? -1 : i, profile_insn_name(i),
+                (unsigned long long) totals->insn_count[i], (unsigned long long) totals->insn_ticks[i],
+                (double) totals->insn_ticks[i] / totals->insn_count[i] * 1e9 / ticksPerSecond);
+        first = 0;
+    }
+
+    fprintf(fp, "\n  ],\n");
+    fprintf(fp, "  \"seeks\": {\n");
+    fprintf(fp, "    \"count\": %llu,\n", (unsigned long long) totals->seek_count);
+    fprintf(fp, "    \"keyframe_jumps\": %llu,\n", (unsigned long long) totals->seek_jumps);
+    fprintf(fp, "    \"packets\": %llu,\n", (unsigned long long) totals->seek_packets);
+    fprintf(fp, "    \"total_ns\": %llu,\n", (unsigned long long) totals->seek_nanoseconds);
+    fprintf(fp, "    \"histogram\": [");
+
+    first = 1;
+
+    // Each bucket is given by its lower bound
+    for (int i = 0; i < PROFILE_SEEK_BUCKETS; i++) {
+        if (totals->seek_histogram[i] == 0) {
+            continue;
+        }
+
+        fprintf(fp, "%s\n      {\"min_ns\": %llu, \"count\": %llu}", first ? "" : ",",
+                i == 0 ? 0ULL : 1ULL << i, (unsigned long long) totals->seek_histogram[i]);
+        first = 0;
+    }
+
+    fprintf(fp, "\n    ]\n");
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+}
+
+int profile_dump(void) {
+    struct profile_counters totals;
+    struct profile_counters *counters;
+    const char *path = getenv("CDG_PROFILE_OUTPUT");
+    uint64_t elapsedNanoseconds = profile_nanoseconds() - startNanoseconds;
+    uint64_t elapsedTicks = profile_ticks() - startTicks;
+    FILE *fp = stderr;
+    int ok = 1;
+
+    memset(&totals, 0, sizeof(struct profile_counters));
+
+    pthread_mutex_lock(&countersLock);
+
+    for (counters = allCounters; counters; counters = counters->next) {
+        for (int i = 0; i < PROFILE_INSN_SLOTS; i++) {
+            totals.insn_count[i] += PROFILE_LOAD(counters->insn_count[i]);
+            totals.insn_ticks[i] += PROFILE_LOAD(counters->insn_ticks[i]);
+        }
+
+        totals.seek_count += PROFILE_LOAD(counters->seek_count);
+        totals.seek_nanoseconds += PROFILE_LOAD(counters->seek_nanoseconds);
+        totals.seek_packets += PROFILE_LOAD(counters->seek_packets);
+        totals.seek_jumps += PROFILE_LOAD(counters->seek_jumps);
+
+        for (int i = 0; i < PROFILE_SEEK_BUCKETS; i++) {
+            totals.seek_histogram[i] += PROFILE_LOAD(counters->seek_histogram[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&countersLock);
+
+    pthread_mutex_lock(&dumpLock);
+
+    // Each dump replaces the last, since the totals only ever grow
+    if (path && *path && (fp = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "%s: failed to open profile output\n", path);
+        ok = 0;
+    } else {
+        profile_write(fp, &totals, elapsedNanoseconds ? elapsedTicks * 1e9 / elapsedNanoseconds : 1e9);
+
+        if (fp == stderr) {
+            fflush(fp);
+        } else if (fclose(fp) != 0) {
+            fprintf(stderr, "%s: failed to write profile output\n", path);
+            ok = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&dumpLock);
+
+    return ok;
+}
+
+static void profile_dump_at_exit(void) {
+    profile_dump();
+}
+
+/* Dumps from an ordinary thread rather than a signal handler, where stdio isn't safe */
+static void *profile_signal_thread(void *arg) {
+    sigset_t *signals = (sigset_t *) arg;
+    int signal;
+
+    while (sigwait(signals, &signal) == 0) {
+        profile_dump();
+    }
+
+    return NULL;
+}
+
+void profile_init(void) {
+    static sigset_t signals;
+    pthread_t thread;
+
+    startNanoseconds = profile_nanoseconds();
+    startTicks = profile_ticks();
+
+    // Blocked here so that every thread created later inherits the mask, and only sigwait() sees it
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (pthread_create(&thread, NULL, profile_signal_thread, &signals) == 0) {
+        pthread_detach(thread);
+    } else {
+        fprintf(stderr, "Failed to start profile signal thread\n");
+    }
+
+    atexit(profile_dump_at_exit);
+}
@@ -0,0 +1,427 @@
+#include "renderer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "shaders.h"
+#include "util.h"
+
+// A single triangle that covers the whole of clip space - cheaper than a quad, with no diagonal seam
+static const GLfloat g_FullscreenTriangle[] = {
+    -1.0f, -1.0f,
+     3.0f, -1.0f,
+    -1.0f,  3.0f
+};
+
+static int renderer_load_program(struct renderer *renderer) {
+    GLuint program = 0;
+
+    // The core profile shaders need GLSL 3.30; anything older gets the GLSL 1.30 fallback
+    if (GLEW_VERSION_3_3) {
+        program = load_shader_program(CDG_VERTEX_SHADER_SOURCE, CDG_FRAGMENT_SHADER_SOURCE);
+        renderer->core_profile = program != 0;
+    }
+
+    if (program == 0) {
+        program = load_shader_program(CDG_COMPAT_VERTEX_SHADER_SOURCE, CDG_COMPAT_FRAGMENT_SHADER_SOURCE);
+    }
+
+    if (program == 0) {
+        fprintf(stderr, "failed to load shader program\n");
+        return 0;
+    }
+
+    renderer->program = program;
+
+    if ((renderer->palette_location = glGetUniformLocation(program, "cdgPalette")) == -1) {
+        fprintf(stderr, "failed to get palette uniform location\n");
+        return 0;
+    }
+
+    if ((renderer->framebuffer_location = glGetUniformLocation(program, "cdgFramebuffer")) == -1) {
+        fprintf(stderr, "failed to get framebuffer uniform location\n");
+        return 0;
+    }
+
+    if ((renderer->screen_size_location = glGetUniformLocation(program, "cdgScreenSize")) == -1) {
+        fprintf(stderr, "failed to get screen size uniform location\n");
+        return 0;
+    }
+
+    if ((renderer->scroll_offset_location = glGetUniformLocation(program, "cdgScrollOffset")) == -1) {
+        fprintf(stderr, "failed to get scroll offset uniform location\n");
+        return 0;
+    }
+
+    if ((renderer->background_location = glGetUniformLocation(program, "cdgBackground")) == -1) {
+        fprintf(stderr, "failed to get background uniform location\n");
+        return 0;
+    }
+
+    // These never change
+    glUseProgram(program);
+    glUniform1i(renderer->framebuffer_location, 0);
+    glUniform1i(renderer->palette_location, 1);
+    glUniform1i(renderer->background_location, 2);
+    glUniform2f(renderer->screen_size_location, (GLfloat) CDG_SCREEN_WIDTH, (GLfloat) CDG_SCREEN_HEIGHT);
+
+    return 1;
+}
+
+static int renderer_create_geometry(struct renderer *renderer) {
+    GLint position = glGetAttribLocation(renderer->program, "position");
+
+    if (position == -1) {
+        fprintf(stderr, "failed to get position attribute location\n");
+        return 0;
+    }
+
+    glGenVertexArrays(1, &renderer->vao);
+    glBindVertexArray(renderer->vao);
+
+    glGenBuffers(1, &renderer->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(g_FullscreenTriangle), g_FullscreenTriangle, GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray((GLuint) position);
+    glVertexAttribPointer((GLuint) position, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), (const void *) 0);
+
+    return 1;
+}
+
+/*
+ * The framebuffer texture holds the raw color table indices as unsigned integers. It is allocated
+ * once, as immutable storage where the driver supports it, and only ever gets partial updates.
+ */
+static void renderer_create_framebuffer_texture(struct renderer *renderer, const struct cdg_state *state) {
+    const uint8_t *framebuffer = cdg_state_get_framebuffer(state);
+
+    glGenTextures(1, &renderer->framebuffer_texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, renderer->framebuffer_texture);
+
+    // Integer textures can't be filtered, so these are needed for the texture to be complete
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage) {
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8UI, CDG_SCREEN_WIDTH, CDG_SCREEN_HEIGHT);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CDG_SCREEN_WIDTH, CDG_SCREEN_HEIGHT, GL_RED_INTEGER, GL_UNSIGNED_BYTE, framebuffer);
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, CDG_SCREEN_WIDTH, CDG_SCREEN_HEIGHT, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, framebuffer);
+    }
+}
+
+/* The palette is a 16x1 RGBA texture, so the shader can look colors up with a single fetch */
+static void renderer_create_palette_texture(struct renderer *renderer, const struct cdg_state *state) {
+    uint8_t palette[16 * 4];
+
+    cdg_state_palette_to_rgba(state, palette);
+
+    glGenTextures(1, &renderer->palette_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, renderer->palette_texture);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage) {
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, 16, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 16, 1, GL_RGBA, GL_UNSIGNED_BYTE, palette);
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 16, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, palette);
+    }
+
+    glActiveTexture(GL_TEXTURE0);
+}
+
+/* The background is filtered, as it's stretched to fit - it starts out as a single black pixel */
+static void renderer_create_background_texture(struct renderer *renderer) {
+    static const uint8_t black[3] = { 0, 0, 0 };
+
+    glGenTextures(1, &renderer->background_texture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, renderer->background_texture);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+    glActiveTexture(GL_TEXTURE0);
+
+    renderer_set_background(renderer, 1, 1, black);
+}
+
+/*
+ * Framebuffer uploads are streamed through a ring of pixel buffers, each the size of the whole
+ * framebuffer, so glTexSubImage2D() never reads client memory or waits on the GPU. Where the driver
+ * has ARB_buffer_storage the buffers are mapped once, persistently, and guarded by fences.
+ */
+static int renderer_create_pbos(struct renderer *renderer) {
+    renderer->persistent = (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) && (GLEW_VERSION_3_3 || GLEW_ARB_sync);
+
+    for (int i = 0; i < RENDERER_PBO_COUNT; i++) {
+        struct renderer_pbo *pbo = &renderer->pbos[i];
+
+        glGenBuffers(1, &pbo->buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->buffer);
+
+        if (renderer->persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, CDG_FRAMEBUFFER_SIZE, NULL, flags);
+
+            if ((pbo->mapping = (uint8_t *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, CDG_FRAMEBUFFER_SIZE, flags)) == NULL) {
+                fprintf(stderr, "failed to map pixel buffer\n");
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return 0;
+            }
+        } else {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, CDG_FRAMEBUFFER_SIZE, NULL, GL_STREAM_DRAW);
+        }
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    return 1;
+}
+
+struct renderer *renderer_new(const struct cdg_state *state) {
+    struct renderer *renderer;
+
+    renderer = (struct renderer *) malloc(sizeof(struct renderer));
+
+    CHECK_MEM(renderer)
+
+    memset(renderer, 0, sizeof(struct renderer));
+
+    if (!renderer_load_program(renderer) || !renderer_create_geometry(renderer)) {
+        renderer_free(renderer);
+        return NULL;
+    }
+
+    renderer_create_framebuffer_texture(renderer, state);
+    renderer_create_palette_texture(renderer, state);
+    renderer_create_background_texture(renderer);
+
+    renderer->h_offset = state->h_offset;
+    renderer->v_offset = state->v_offset;
+    glUniform2i(renderer->scroll_offset_location, renderer->h_offset, renderer->v_offset);
+
+    if (!renderer_create_pbos(renderer)) {
+        renderer_free(renderer);
+        return NULL;
+    }
+
+    return renderer;
+}
+
+void renderer_free(struct renderer *renderer) {
+    if (renderer) {
+        for (int i = 0; i < RENDERER_PBO_COUNT; i++) {
+            if (renderer->pbos[i].fence) {
+                glDeleteSync(renderer->pbos[i].fence);
+            }
+
+            // Deleting a buffer also unmaps it
+            if (renderer->pbos[i].buffer) {
+                glDeleteBuffers(1, &renderer->pbos[i].buffer);
+            }
+        }
+
+        if (renderer->background_texture) {
+            glDeleteTextures(1, &renderer->background_texture);
+        }
+
+        if (renderer->palette_texture) {
+            glDeleteTextures(1, &renderer->palette_texture);
+        }
+
+        if (renderer->framebuffer_texture) {
+            glDeleteTextures(1, &renderer->framebuffer_texture);
+        }
+
+        if (renderer->vbo) {
+            glDeleteBuffers(1, &renderer->vbo);
+        }
+
+        if (renderer->vao) {
+            glDeleteVertexArrays(1, &renderer->vao);
+        }
+
+        if (renderer->program) {
+            glDeleteProgram(renderer->program);
+        }
+
+        free(renderer);
+    }
+}
+
+/*
+ * Claim the next pixel buffer slot for writing. Returns NULL if the GPU might still be reading
+ * from it, in which case the upload should be tried again on a later frame.
+ */
+static uint8_t *renderer_pbo_begin(struct renderer *renderer) {
+    struct renderer_pbo *pbo = &renderer->pbos[renderer->pbo_index];
+    uint8_t *pixels;
+
+    if (pbo->fence) {
+        if (glClientWaitSync(pbo->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) {
+            return NULL;
+        }
+
+        glDeleteSync(pbo->fence);
+        pbo->fence = NULL;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->buffer);
+
+    if (renderer->persistent) {
+        return pbo->mapping;
+    }
+
+    // Without persistent mappings, orphan the old storage so the driver never has to wait for it
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, CDG_FRAMEBUFFER_SIZE, NULL, GL_STREAM_DRAW);
+
+    pixels = (uint8_t *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, CDG_FRAMEBUFFER_SIZE,
+                                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+
+    if (pixels == NULL) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    return pixels;
+}
+
+static void renderer_pbo_end(struct renderer *renderer) {
+    struct renderer_pbo *pbo = &renderer->pbos[renderer->pbo_index];
+
+    // Orphaned buffers are tracked by the driver, persistent ones have to be fenced by hand
+    if (renderer->persistent) {
+        pbo->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    renderer->pbo_index = (renderer->pbo_index + 1) % RENDERER_PBO_COUNT;
+}
+
+int renderer_update(struct renderer *renderer, struct cdg_state *state) {
+    struct cdg_rect rects[CDG_MAX_DIRTY_RECTS];
+    uint8_t palette[16 * 4];
+    const uint8_t *framebuffer = cdg_state_get_framebuffer(state);
+    uint8_t *pixels;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (cdg_state_has_dirty_rects(state)) {
+        size_t count;
+
+        // Leave everything dirty if there's nowhere to put it yet, rather than stall
+        if ((pixels = renderer_pbo_begin(renderer)) == NULL) {
+            return 0;
+        }
+
+        count = cdg_state_take_dirty_rects(state, rects);
+
+        // The buffer mirrors the framebuffer layout, so only the changed rows need copying
+        for (size_t i = 0; i < count; i++) {
+            for (int y = rects[i].y; y < rects[i].y + rects[i].height; y++) {
+                size_t offset = ARRAY_INDEX(rects[i].x, y);
+
+                memcpy(pixels + offset, framebuffer + offset, rects[i].width);
+            }
+        }
+
+        // A buffer can't be the source of an upload while it's mapped, unless it's mapped persistently
+        if (!renderer->persistent) {
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, renderer->framebuffer_texture);
+
+        // Only upload the parts of the framebuffer that changed, straight from the bound buffer
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, CDG_SCREEN_WIDTH);
+
+        for (size_t i = 0; i < count; i++) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, rects[i].x, rects[i].y, rects[i].width, rects[i].height,
+                            GL_RED_INTEGER, GL_UNSIGNED_BYTE, (const void *) (uintptr_t) ARRAY_INDEX(rects[i].x, rects[i].y));
+        }
+
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+        renderer_pbo_end(renderer);
+    }
+
+    // Fine scrolling is just a matter of where the shader reads from - only set after any upload, so both change together
+    if (state->h_offset != renderer->h_offset || state->v_offset != renderer->v_offset) {
+        renderer->h_offset = state->h_offset;
+        renderer->v_offset = state->v_offset;
+
+        glUseProgram(renderer->program);
+        glUniform2i(renderer->scroll_offset_location, renderer->h_offset, renderer->v_offset);
+    }
+
+    // Only touch the palette when a LOAD_COLOR_TABLE (or a seek) changed it - it's tiny, so it goes straight from here
+    if (cdg_state_take_palette(state, palette)) {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, renderer->palette_texture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 16, 1, GL_RGBA, GL_UNSIGNED_BYTE, palette);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    return 1;
+}
+
+void renderer_set_background(struct renderer *renderer, int width, int height, const uint8_t *rgb) {
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, renderer->background_texture);
+
+    // PPM rows are packed, and video frames come straight from client memory rather than a buffer
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // Frames of a video are all the same size, so only the first needs new storage
+    if (width != renderer->background_width || height != renderer->background_height) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+        renderer->background_width = width;
+        renderer->background_height = height;
+    } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+    }
+
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void renderer_draw(struct renderer *renderer) {
+    glUseProgram(renderer->program);
+
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, renderer->background_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, renderer->palette_texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, renderer->framebuffer_texture);
+
+    glBindVertexArray(renderer->vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void renderer_resize(struct renderer *renderer, int width, int height) {
+    UNUSED(renderer);
+
+    glViewport(0, 0, width, height);
+}
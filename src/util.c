@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static int stdoutCopy;
 static int stderrCopy;
@@ -36,6 +39,52 @@ int read_file(const char *path, char **buf, unsigned long *size) {
     return 1;
 }
 
+/* Map a whole file read-only. An empty file maps to a NULL buffer. */
+int map_file(const char *path, const uint8_t **buf, size_t *size) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    *buf = NULL;
+    *size = (size_t) st.st_size;
+
+    if (*size == 0) {
+        close(fd);
+        return 1;
+    }
+
+    map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping keeps its own reference to the file
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        *size = 0;
+        return 0;
+    }
+
+    *buf = (const uint8_t *) map;
+
+    return 1;
+}
+
+void unmap_file(const uint8_t *buf, size_t size) {
+    if (buf) {
+        munmap((void *) buf, size);
+    }
+}
+
 void backup_and_close_stdout_stderr(void) {
     stdoutCopy = dup(STDOUT_FILENO);
     stderrCopy = dup(STDERR_FILENO);